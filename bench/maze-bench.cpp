@@ -0,0 +1,273 @@
+// Microbenchmarks of the simulator hot paths and the render stages, on fixed
+// mazes and seeds. Run from the repo root (sprites are loaded from img/):
+//   ./maze-bench results.tsv [baseline.tsv]
+// Results are written as "name<TAB>iterations<TAB>ns per iteration" lines;
+// given a baseline in the same format, any benchmark more than bench_tolerance
+// times slower than it is reported and the exit status is 1.
+
+#define no_main
+#include "../maze-game-server.cpp"
+
+#include <functional>
+#include <iomanip>
+
+#define bench_tolerance 1.25
+#define bench_runs 5
+#define bench_seed 20240601u
+#define bench_frames 12
+
+class GameBench
+{
+public:
+  // One row of results
+  class Result
+  {
+  public:
+    string name;
+    long iterations;
+    double ns;
+  };
+
+private:
+  string label;
+  Game *game;
+  Robot *bot;
+  vector<Result> &results;
+
+  // Best of bench_runs runs of fn(i) for i in [0, n)
+  void run(const string &name, long n, function<void(long)> fn);
+
+  // Puts the bot at rest in the middle of tile i (row-major)
+  void place(long i);
+
+public:
+  // The agent is never sent anything, so it only has to stay quiet
+  GameBench(const string &_label, const string &mazepath, vector<Result> &_results);
+  ~GameBench();
+
+  void sense();
+  void collide();
+  void move();
+  void parse();
+  void render();
+
+  static void write(const vector<Result> &results, const string &path);
+
+  // Number of benchmarks slower than the baseline by more than bench_tolerance
+  static int compare(const vector<Result> &results, const string &path);
+
+  static vector<Result> all(const vector<pair<string, string>> &mazes);
+};
+
+GameBench::GameBench(const string &_label, const string &mazepath, vector<Result> &_results)
+    : label(_label), game(nullptr), bot(nullptr), results(_results)
+{
+  // Coins are placed with _mt
+  _mt.seed(bench_seed);
+  Game::renderthreads = false;
+  Game::metricspath = "";
+  Game::agenttimeout = 0;
+  game = new Game(mazepath, "cat", RenderTier());
+  bot = game->players[0];
+  // Past the first frame, which also carries the maze size
+  game->framecount = 1;
+}
+
+GameBench::~GameBench()
+{
+  delete game;
+}
+
+void GameBench::run(const string &name, long n, function<void(long)> fn)
+{
+  double best = 0;
+  for (int r = 0; r < bench_runs; ++r)
+  {
+    const auto t0 = chrono::steady_clock::now();
+    for (long i = 0; i < n; ++i)
+      fn(i);
+    const double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / n;
+    if (r == 0 || ns < best)
+      best = ns;
+  }
+  results.push_back(Result{label + "/" + name, n, best});
+  cerr << label << "/" << name << ": " << best << " ns" << endl;
+}
+
+void GameBench::place(long i)
+{
+  const long tile = i % (game->tileW * game->tileH);
+  bot->setX(tile % game->tileW + 0.5);
+  bot->setY(tile / game->tileW + 0.5);
+  bot->setV(0);
+}
+
+void GameBench::sense()
+{
+  set<IElem *> visible;
+  const long n = game->tileW * game->tileH;
+  run("sense", n, [&](long i)
+      {
+        place(i);
+        visible.clear();
+        game->writeRenderViewFrom(bot, visible); });
+  if (game->tileW == 11 && game->tileH == 11)
+    run("sense_11x11", n, [&](long i)
+        {
+          place(i);
+          visible.clear();
+          game->senseFrom<11, 11>(bot, visible); });
+}
+
+void GameBench::collide()
+{
+  // Moving toward the tile to the right so some walls are hit
+  run("collide", game->tileW * game->tileH * 8, [&](long i)
+      {
+        place(i / 8);
+        bot->setA(0);
+        bot->setV(robot_maxv);
+        SimStep<0, 0, 0>::collide(*game, bot); });
+}
+
+void GameBench::move()
+{
+  run("move", 100000, [&](long i)
+      {
+        if (i % 256 == 0)
+        {
+          place(i / 256);
+          bot->runCommand("toward " + to_string(game->tileW - 0.5) + " " + to_string(game->tileH - 0.5));
+        }
+        bot->move(); });
+}
+
+void GameBench::parse()
+{
+  // "block" is left out, as it logs every use
+  const string cmds[4] = {"toward 3.5 2.5", "toward 10.25 0.75", "himynameis bench", "comment looking around"};
+  run("parse", 100000, [&](long i)
+      { bot->runCommand(cmds[i % 4]); });
+}
+
+void GameBench::render()
+{
+  // Drive each stage over the same bench_frames frames in turn, as the
+  // render threads would, starting with the simulator's part in renderFrame
+  system("mkdir -p out/");
+  game->renderlimit = bench_frames;
+  set<IElem *> visible;
+  const auto frame = [&](long i)
+  {
+    place(i * 7);
+    visible.clear();
+    game->writeRenderViewFrom(bot, visible);
+    game->renderFrame(visible);
+  };
+  const auto stage = [&](const string &name, void (*loop)(Game *))
+  {
+    const auto t0 = chrono::steady_clock::now();
+    loop(game);
+    const double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / bench_frames;
+    results.push_back(Result{label + "/" + name, bench_frames, ns});
+    cerr << label << "/" << name << ": " << ns << " ns" << endl;
+  };
+  for (int r = 0; r < bench_runs; ++r)
+  {
+    // Frames pile up in the first queue until the stages run below
+    const auto t0 = chrono::steady_clock::now();
+    for (long i = 0; i < bench_frames; ++i)
+      frame(i);
+    const double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count() / bench_frames;
+    // Only the last run of the stages is kept, they are slow
+    if (r < bench_runs - 1)
+    {
+      Game::RenderMessage *msg;
+      while (game->to_renderer[0]->pop(msg))
+        delete msg;
+      continue;
+    }
+    results.push_back(Result{label + "/renderframe", bench_frames, ns});
+    stage("renderloop0", Game::renderloop0);
+    stage("renderloop1", Game::renderloop1);
+    stage("renderloop2", Game::renderloop2);
+    stage("renderloop3", Game::renderloop3);
+    stage("renderloop4", Game::renderloop4);
+  }
+}
+
+void GameBench::write(const vector<Result> &results, const string &path)
+{
+  ofstream out(path);
+  for (const Result &r : results)
+    out << r.name << "\t" << r.iterations << "\t" << fixed << setprecision(1) << r.ns << "\n";
+  myassert(out.good(), "Could not write " + path);
+}
+
+int GameBench::compare(const vector<Result> &results, const string &path)
+{
+  ifstream in(path);
+  myassert(in.good(), "Could not read baseline " + path);
+  map<string, double> baseline;
+  string name;
+  long iterations;
+  double ns;
+  while (in >> name >> iterations >> ns)
+    baseline[name] = ns;
+
+  int regressions = 0;
+  cout << "benchmark\tns\tbaseline\tratio" << endl;
+  for (const Result &r : results)
+  {
+    if (!baseline.count(r.name))
+    {
+      cout << r.name << "\t" << r.ns << "\t-\t-" << endl;
+      continue;
+    }
+    const double ratio = r.ns / baseline[r.name];
+    const bool slower = ratio > bench_tolerance;
+    regressions += slower;
+    cout << r.name << "\t" << r.ns << "\t" << baseline[r.name] << "\t" << ratio << (slower ? "\tREGRESSION" : "") << endl;
+  }
+  return regressions;
+}
+
+vector<GameBench::Result> GameBench::all(const vector<pair<string, string>> &mazes)
+{
+  vector<Result> results;
+  for (const pair<string, string> &maze : mazes)
+  {
+    GameBench bench(maze.first, maze.second, results);
+    bench.sense();
+    bench.collide();
+    bench.move();
+    bench.parse();
+    bench.render();
+  }
+  return results;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2 && argc != 3)
+  {
+    cout << "Use: ./maze-bench results.tsv [baseline.tsv]" << endl;
+    return 0;
+  }
+  InitializeMagick(*argv);
+
+  // The stock maze and a larger generated one
+  const vector<GameBench::Result> results = GameBench::all({{"maze0", "mazepool/0.maze"},
+                                                           {"kruskal31", "gen:kruskal:1:31x31"}});
+  GameBench::write(results, argv[1]);
+  if (argc == 3)
+  {
+    const int regressions = GameBench::compare(results, argv[2]);
+    if (regressions > 0)
+    {
+      cout << regressions << " benchmarks regressed by more than " << bench_tolerance << "x" << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -5,30 +5,43 @@ import time
 import random
 
 
-# current exact position
-x = 0.5
-y = 0.5
-home_x,home_y = 0,0
-
-# last tile "reached" (i.e., being close enough to center)
-ty = -1
-tx = -1
+# maze size in tiles, updated by the server's first "maze W H" line
+W, H = 11, 11
 
 # set of walls known
 walls = set()
-for i in range(0,11):
-  walls |= {(i,0,i+0,0), (i,11,i+1,11), (0,i,0,i+1), (11,i,11,i+1)}
+def add_border_walls():
+  global walls
+  for i in range(0,W):
+    walls |= {(i,0,i+1,0), (i,H,i+1,H)}
+  for i in range(0,H):
+    walls |= {(0,i,0,i+1), (W,i,W,i+1)}
 
-# DFS tree
-plan = []
-seen = set()
-dead = set()
+# forget everything about the last maze, for the first game and on "reset"
+def new_game():
+  global x, y, home_x, home_y, tx, ty, W, H, walls, plan, seen, dead
+  # current exact position
+  x = 0.5
+  y = 0.5
+  home_x,home_y = 0,0
+  # last tile "reached" (i.e., being close enough to center)
+  ty = -1
+  tx = -1
+  W, H = 11, 11
+  walls = set()
+  add_border_walls()
+  # DFS tree
+  plan = []
+  seen = set()
+  dead = set()
+  # introduce ourselves, all friendly like
+  print("himynameis DFS-bot", flush=True)
 
-# introduce ourselves, all friendly like
-print("himynameis DFS-bot", flush=True)
+new_game()
 
-# Wait a few seconds for some initial sense data
-time.sleep(0.25)
+# The server starts the game once we have introduced ourselves;
+# block until the first sense data arrives
+select.select([sys.stdin,],[],[])
 
 while True:
   # while there is new input on stdin:
@@ -37,6 +50,16 @@ while True:
     obs = sys.stdin.readline()
     obs = obs.split(" ")
     if obs == []: pass
+    elif obs[0].strip() == "reset":
+      # the server kept us running for another game
+      new_game()
+    elif obs[0] == "maze":
+      W = int(obs[1])
+      H = int(obs[2])
+      # this comes before any wall, so only the guessed 11x11 border is known;
+      # drop it, or it would wall us in on larger mazes
+      walls = set()
+      add_border_walls()
     elif obs[0] == "bot":
       # update our own position
       x = float(obs[1])
@@ -67,16 +90,16 @@ while True:
     seen |= {(tx,ty)} # marking the tile as seen
     # returned back to origin
     if(plan[-1][0] == home_x) and (plan[-1][1] == home_y):
-      dead -= {(10,10)}
+      dead -= {(W-1,H-1)}
       seen = {(tx,ty)}
 
     # if we've hit our opposing corner:
-    if(plan[-1][0] == 10) and (plan[-1][1] == 10):
+    if(plan[-1][0] == W-1) and (plan[-1][1] == H-1):
       # mark all other tiles dead, this is our final path, backtrack
       planset = set(plan)
       dead = set()
-      for i in range(11):
-        for j in range(11):
+      for i in range(W):
+        for j in range(H):
           if (i,j) not in planset:
             dead |= {(i,j)} # also means, there is only one way to move
       seen = set()
@@ -0,0 +1,157 @@
+// A "Maze Game" Server
+// Copyright (c) Thomas Gilray, 2023
+//
+// For use with CS 660/760. All rights reserved.
+//
+// Inert stand-ins for the parts of Magick++ the server uses, for headless
+// builds (-Dno_render, see the libmazesim and headless Makefile targets).
+// Images hold nothing and drawing does nothing; Game::rendering is false in
+// these builds, so none of it is reached while playing.
+
+#pragma once
+
+#include <string>
+#include <cstddef>
+#include <exception>
+#include <sys/types.h>
+
+namespace Magick
+{
+  enum CompositeOperator
+  {
+    OverCompositeOp,
+    CopyCompositeOp
+  };
+  enum GravityType
+  {
+    WestGravity,
+    NorthWestGravity,
+    CenterGravity
+  };
+  enum LineCap
+  {
+    RoundCap
+  };
+  enum StorageType
+  {
+    CharPixel
+  };
+  enum FilterTypes
+  {
+    BoxFilter,
+    TriangleFilter,
+    LanczosFilter,
+    PointFilter
+  };
+
+  typedef unsigned short Quantum;
+
+  class PixelPacket
+  {
+  public:
+    Quantum red, green, blue, opacity;
+  };
+
+  class Geometry
+  {
+  public:
+    Geometry() {}
+    Geometry(size_t, size_t, ssize_t = 0, ssize_t = 0) {}
+    Geometry(const std::string &) {}
+    Geometry(const char *) {}
+    size_t width() const { return 0; }
+    size_t height() const { return 0; }
+  };
+
+  class Color
+  {
+  public:
+    Color() {}
+    Color(const std::string &) {}
+    Color(const char *) {}
+  };
+
+  class Blob
+  {
+  public:
+    Blob() {}
+    Blob(const void *, size_t) {}
+    const void *data() const { return 0; }
+    size_t length() const { return 0; }
+  };
+
+  class Drawable
+  {
+  };
+
+  class DrawableLine : public Drawable
+  {
+  public:
+    DrawableLine(double, double, double, double) {}
+  };
+
+  class Exception : public std::exception
+  {
+  public:
+    const char *what() const noexcept { return "headless build has no images"; }
+  };
+
+  class Image
+  {
+  public:
+    Image() {}
+    Image(const std::string &) {}
+    Image(const char *) {}
+    Image(const Geometry &, const Color &) {}
+    Image(size_t, size_t, const std::string &, StorageType, const void *) {}
+    Image(const Blob &) {}
+
+    void composite(const Image &, ssize_t, ssize_t, CompositeOperator = OverCompositeOp) {}
+    void composite(const Image &, const Geometry &, CompositeOperator = OverCompositeOp) {}
+    void zoom(const Geometry &) {}
+    void crop(const Geometry &) {}
+    void flop() {}
+    void resize(const Geometry &) {}
+    void scale(const Geometry &) {}
+    void annotate(const std::string &, const Geometry &, GravityType = WestGravity) {}
+    void font(const std::string &) {}
+    void fontPointsize(double) {}
+    void strokeColor(const Color &) {}
+    void fillColor(const Color &) {}
+    void strokeWidth(double) {}
+    void strokeLineCap(LineCap) {}
+    void draw(const Drawable &) {}
+    void write(const std::string &) {}
+    void write(Blob *) {}
+    void write(ssize_t, ssize_t, size_t, size_t, const std::string &, StorageType, void *) const {}
+    void read(const std::string &) {}
+    void read(const Blob &) {}
+    void read(size_t, size_t, const std::string &, StorageType, const void *) {}
+    void magick(const std::string &) {}
+    void depth(size_t) {}
+    void quality(size_t) {}
+    void filterType(FilterTypes) {}
+    void backgroundColor(const Color &) {}
+    void matte(bool) {}
+    void modifyImage() {}
+    size_t columns() const { return 0; }
+    size_t rows() const { return 0; }
+    Geometry size() const { return Geometry(); }
+    PixelPacket *getPixels(ssize_t, ssize_t, size_t, size_t) { return 0; }
+    const PixelPacket *getConstPixels(ssize_t, ssize_t, size_t, size_t) const { return 0; }
+    void syncPixels() {}
+  };
+
+  inline void InitializeMagick(const char *) {}
+}
+
+// GraphicsMagick's C API, which Magick++ wraps in this namespace
+namespace MagickLib
+{
+  enum ResourceType
+  {
+    ThreadsResource
+  };
+
+  inline unsigned int SetMagickResourceLimit(ResourceType, long long) { return 1; }
+}
@@ -7,6 +7,384 @@
 
 #include </root/maze-game/maze-game-server.hpp>
 
+const Image &Scene::SpriteCache::get(const Image *sprite, int w, int h, bool flop)
+{
+  const tuple<const Image *, int, int, bool> key(sprite, w, h, flop);
+  auto it = sized.find(key);
+  if (it == sized.end())
+  {
+    Image img(*sprite);
+    if (flop)
+      img.flop();
+    if (w != (int)sprite->columns() || h != (int)sprite->rows())
+      img.zoom(Geometry(w, h));
+    it = sized.insert(make_pair(key, img)).first;
+  }
+  return it->second;
+}
+
+Scene::Scene() : lines(), sprites() {}
+Scene::~Scene() {}
+
+void Scene::addSprite(const Image *sprite, double x0, double y0, double scale, bool flop)
+{
+  Item item = {sprite, x0, y0, 0, 0, scale, flop, "", 0};
+  sprites.push_back(item);
+}
+
+void Scene::addLine(double x0, double y0, double x1, double y1, const string &color, double width)
+{
+  Item item = {0, x0, y0, x1, y1, 1.0, false, color, width};
+  lines.push_back(item);
+}
+
+void Scene::drawTo(Image &canvas, double zoom, int ox, int oy, SpriteCache &cache) const
+{
+  const int cw = canvas.columns(), ch = canvas.rows();
+  canvas.strokeLineCap(RoundCap);
+  for (const Item &ln : lines)
+  {
+    const double pad = ln.width * zoom;
+    if (max(ln.x0, ln.x1) * zoom + pad < ox || min(ln.x0, ln.x1) * zoom - pad > ox + cw ||
+        max(ln.y0, ln.y1) * zoom + pad < oy || min(ln.y0, ln.y1) * zoom - pad > oy + ch)
+      continue;
+    canvas.strokeWidth(ln.width * zoom);
+    canvas.strokeColor(Color(ln.color));
+    canvas.draw(DrawableLine(ln.x0 * zoom - ox, ln.y0 * zoom - oy, ln.x1 * zoom - ox, ln.y1 * zoom - oy));
+  }
+  for (const Item &sp : sprites)
+  {
+    const int w = max((int)lround(sp.sprite->columns() * sp.scale * zoom), 1);
+    const int h = max((int)lround(sp.sprite->rows() * sp.scale * zoom), 1);
+    const int x = (int)lround(sp.x0 * zoom) - ox, y = (int)lround(sp.y0 * zoom) - oy;
+    if (x + w < 0 || x > cw || y + h < 0 || y > ch)
+      continue;
+    canvas.composite(cache.get(sp.sprite, w, h, sp.flop), x, y, OverCompositeOp);
+  }
+}
+
+static inline uint32_t premultiply(uint32_t p)
+{
+  const uint32_t a = p >> 24;
+  uint32_t out = a << 24;
+  for (int c = 0; c < 24; c += 8)
+    out |= ((((p >> c) & 0xff) * a + 127) / 255) << c;
+  return out;
+}
+
+static inline uint32_t unpremultiply(uint32_t p)
+{
+  const uint32_t a = p >> 24;
+  if (a == 0 || a == 255)
+    return p;
+  uint32_t out = a << 24;
+  for (int c = 0; c < 24; c += 8)
+    out |= min((((p >> c) & 0xff) * 255 + a / 2) / a, 255u) << c;
+  return out;
+}
+
+static inline uint32_t scalePixel(uint32_t p, double f)
+{
+  uint32_t out = 0;
+  for (int c = 0; c < 32; c += 8)
+    out |= (uint32_t)(((p >> c) & 0xff) * f + 0.5) << c;
+  return out;
+}
+
+static inline uint32_t blendPixel(uint32_t d, uint32_t s)
+{
+  const uint32_t ia = 255 - (s >> 24);
+  uint32_t out = 0;
+  for (int c = 0; c < 32; c += 8)
+  {
+    uint32_t x = ((d >> c) & 0xff) * ia + 128;
+    x = (x + (x >> 8)) >> 8;
+    out |= min(x + ((s >> c) & 0xff), 255u) << c;
+  }
+  return out;
+}
+
+// Premultiplied alpha-over of n src pixels onto dst: d = s + d * (255 - sa) / 255
+static void blendRow(uint32_t *dst, const uint32_t *src, int n)
+{
+  int i = 0;
+#if defined(__AVX2__)
+  {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8((char)0xff);
+    const __m256i half = _mm256_set1_epi16(128);
+    for (; i + 8 <= n; i += 8)
+    {
+      const __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+      if (_mm256_testz_si256(s, s))
+        continue; // fully transparent
+      const __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+      __m256i a = _mm256_srli_epi32(s, 24);
+      a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+      a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+      a = _mm256_xor_si256(a, ones);
+      __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_unpacklo_epi8(a, zero));
+      __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_unpackhi_epi8(a, zero));
+      lo = _mm256_add_epi16(lo, half);
+      hi = _mm256_add_epi16(hi, half);
+      lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+      hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+      _mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s));
+    }
+  }
+#endif
+#if defined(__SSE2__)
+  {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xff);
+    const __m128i half = _mm_set1_epi16(128);
+    for (; i + 4 <= n; i += 4)
+    {
+      const __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+      if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+        continue; // fully transparent
+      const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+      __m128i a = _mm_srli_epi32(s, 24);
+      a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+      a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+      a = _mm_xor_si128(a, ones);
+      __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_unpacklo_epi8(a, zero));
+      __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_unpackhi_epi8(a, zero));
+      lo = _mm_add_epi16(lo, half);
+      hi = _mm_add_epi16(hi, half);
+      lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+      hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epu8(_mm_packus_epi16(lo, hi), s));
+    }
+  }
+#endif
+  for (; i < n; ++i)
+    dst[i] = blendPixel(dst[i], src[i]);
+}
+
+// acc[4 * i + c] += wt * src[i].c for n pixels
+static void accumulateRow(float *acc, const uint32_t *src, int n, float wt)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 w = _mm_set1_ps(wt);
+  for (; i < n; ++i)
+  {
+    const __m128i p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)src[i]), zero), zero);
+    _mm_storeu_ps(acc + 4 * i, _mm_add_ps(_mm_loadu_ps(acc + 4 * i), _mm_mul_ps(_mm_cvtepi32_ps(p), w)));
+  }
+#endif
+  for (; i < n; ++i)
+    for (int c = 0; c < 4; ++c)
+      acc[4 * i + c] += wt * ((src[i] >> (8 * c)) & 0xff);
+}
+
+// Box-filter weights: dst index i covers src indices first[i] .. first[i] + count[i] - 1
+static void boxWeights(int sn, int dn, vector<int> &first, vector<int> &count, vector<float> &weights)
+{
+  const double scale = (double)sn / dn;
+  for (int i = 0; i < dn; ++i)
+  {
+    const double lo = i * scale, hi = (i + 1) * scale;
+    const int k0 = (int)floor(lo);
+    const int k1 = min((int)ceil(hi), sn);
+    first.push_back(k0);
+    count.push_back(k1 - k0);
+    for (int k = k0; k < k1; ++k)
+      weights.push_back((float)((min(hi, k + 1.0) - max(lo, (double)k)) / scale));
+  }
+}
+
+Raster::Raster()
+    : w(0), h(0), px(), strokewidth(1), strokecolor(0xff000000),
+      clipx0(0), clipy0(0), clipx1(0), clipy1(0)
+{
+}
+
+Raster::Raster(int _w, int _h, uint32_t fill)
+    : w(_w), h(_h), px(_w * _h, fill), strokewidth(1), strokecolor(0xff000000),
+      clipx0(0), clipy0(0), clipx1(_w), clipy1(_h)
+{
+}
+
+Raster::Raster(const Image &img)
+    : w(img.columns()), h(img.rows()), px(w * h), strokewidth(1), strokecolor(0xff000000),
+      clipx0(0), clipy0(0), clipx1(w), clipy1(h)
+{
+  Image src(img);
+  src.write(0, 0, w, h, "RGBA", CharPixel, px.data());
+  for (uint32_t &p : px)
+    p = premultiply(p);
+}
+
+Raster::~Raster() {}
+
+int Raster::width() const { return w; }
+int Raster::height() const { return h; }
+uint32_t *Raster::row(int y) { return px.data() + (size_t)y * w; }
+const uint32_t *Raster::row(int y) const { return px.data() + (size_t)y * w; }
+
+Image Raster::toImage() const
+{
+  vector<uint32_t> out(px.size());
+  for (size_t i = 0; i < px.size(); ++i)
+    out[i] = unpremultiply(px[i]);
+  return Image(w, h, "RGBA", CharPixel, out.data());
+}
+
+uint32_t Raster::parseColor(const string &hex)
+{
+  if (hex.size() != 7 || hex[0] != '#')
+    return 0xff000000;
+  const uint32_t rgb = stoul(hex.substr(1), nullptr, 16);
+  return 0xff000000 | ((rgb >> 16) & 0xff) | (rgb & 0xff00) | ((rgb & 0xff) << 16);
+}
+
+void Raster::strokeWidth(double _w) { strokewidth = _w; }
+void Raster::strokeColor(const string &hex) { strokecolor = parseColor(hex); }
+
+void Raster::clip(int x0, int y0, int x1, int y1)
+{
+  clipx0 = max(x0, 0);
+  clipy0 = max(y0, 0);
+  clipx1 = min(x1, w);
+  clipy1 = min(y1, h);
+}
+
+void Raster::unclip() { clip(0, 0, w, h); }
+
+void Raster::fill(int x, int y, int fw, int fh, uint32_t color)
+{
+  const int x0 = max(x, clipx0), x1 = min(x + fw, clipx1);
+  for (int j = max(y, clipy0); j < min(y + fh, clipy1); ++j)
+    for (int i = x0; i < x1; ++i)
+      row(j)[i] = color;
+}
+
+void Raster::copyFrom(const Raster &src, int x, int y, int cw, int ch)
+{
+  const int x0 = max(x, 0), x1 = min(x + cw, min(w, src.w));
+  if (x1 <= x0)
+    return;
+  for (int j = max(y, 0); j < min(y + ch, min(h, src.h)); ++j)
+    copy(src.row(j) + x0, src.row(j) + x1, row(j) + x0);
+}
+
+void Raster::composite(const Raster &src, int x, int y)
+{
+  const int x0 = max(x, clipx0), x1 = min(x + src.w, clipx1);
+  const int y0 = max(y, clipy0), y1 = min(y + src.h, clipy1);
+  if (x1 <= x0)
+    return;
+  for (int j = y0; j < y1; ++j)
+    blendRow(row(j) + x0, src.row(j - y) + (x0 - x), x1 - x0);
+}
+
+void Raster::flop()
+{
+  for (int j = 0; j < h; ++j)
+    reverse(row(j), row(j) + w);
+}
+
+Raster Raster::zoomed(int zw, int zh) const
+{
+  Raster out(zw, zh);
+  for (int j = 0; j < zh; ++j)
+  {
+    const double fy = min(max((j + 0.5) * h / zh - 0.5, 0.0), h - 1.0);
+    const int y0 = (int)fy, y1 = min(y0 + 1, h - 1);
+    const double ty = fy - y0;
+    for (int i = 0; i < zw; ++i)
+    {
+      const double fx = min(max((i + 0.5) * w / zw - 0.5, 0.0), w - 1.0);
+      const int x0 = (int)fx, x1 = min(x0 + 1, w - 1);
+      const double tx = fx - x0;
+      const uint32_t p00 = row(y0)[x0], p01 = row(y0)[x1], p10 = row(y1)[x0], p11 = row(y1)[x1];
+      uint32_t p = 0;
+      for (int c = 0; c < 32; c += 8)
+      {
+        const double top = ((p00 >> c) & 0xff) * (1 - tx) + ((p01 >> c) & 0xff) * tx;
+        const double bot = ((p10 >> c) & 0xff) * (1 - tx) + ((p11 >> c) & 0xff) * tx;
+        p |= (uint32_t)(top * (1 - ty) + bot * ty + 0.5) << c;
+      }
+      out.row(j)[i] = p;
+    }
+  }
+  return out;
+}
+
+void Raster::resampleTo(Raster &dst, int sx, int sy, int sw, int sh,
+                        int dx, int dy, int dw, int dh) const
+{
+  vector<int> xfirst, xcount, yfirst, ycount;
+  vector<float> xweights, yweights;
+  boxWeights(sw, dw, xfirst, xcount, xweights);
+  boxWeights(sh, dh, yfirst, ycount, yweights);
+
+  // Vertical pass into a float row, then horizontal pass into dst
+  vector<float> acc(4 * sw);
+  int yo = 0;
+  for (int j = 0; j < dh; ++j)
+  {
+    fill_n(acc.begin(), acc.size(), 0.0f);
+    for (int k = 0; k < ycount[j]; ++k)
+      accumulateRow(acc.data(), row(sy + yfirst[j] + k) + sx, sw, yweights[yo + k]);
+    yo += ycount[j];
+
+    uint32_t *out = dst.row(dy + j) + dx;
+    int xo = 0;
+    for (int i = 0; i < dw; ++i)
+    {
+      float c[4] = {0, 0, 0, 0};
+      for (int k = 0; k < xcount[i]; ++k)
+      {
+        const float wt = xweights[xo + k];
+        const float *a = acc.data() + 4 * (xfirst[i] + k);
+        c[0] += wt * a[0];
+        c[1] += wt * a[1];
+        c[2] += wt * a[2];
+        c[3] += wt * a[3];
+      }
+      xo += xcount[i];
+      uint32_t p = 0;
+      for (int ch = 0; ch < 4; ++ch)
+        p |= (uint32_t)min(c[ch] + 0.5f, 255.0f) << (8 * ch);
+      out[i] = p;
+    }
+  }
+}
+
+void Raster::drawLine(double x0, double y0, double x1, double y1)
+{
+  // Coverage of a capsule of radius r around the segment, at pixel centers
+  const double r = strokewidth / 2.0;
+  const double dx = x1 - x0, dy = y1 - y0;
+  const double len2 = dx * dx + dy * dy;
+  const int bx0 = max((int)floor(min(x0, x1) - r - 1), clipx0);
+  const int by0 = max((int)floor(min(y0, y1) - r - 1), clipy0);
+  const int bx1 = min((int)ceil(max(x0, x1) + r + 1), clipx1);
+  const int by1 = min((int)ceil(max(y0, y1) + r + 1), clipy1);
+  for (int j = by0; j < by1; ++j)
+    for (int i = bx0; i < bx1; ++i)
+    {
+      const double px0 = i + 0.5, py0 = j + 0.5;
+      const double t = len2 > 0 ? min(max(((px0 - x0) * dx + (py0 - y0) * dy) / len2, 0.0), 1.0) : 0.0;
+      const double ex = px0 - (x0 + t * dx), ey = py0 - (y0 + t * dy);
+      const double cov = min(max(r + 0.5 - sqrt(ex * ex + ey * ey), 0.0), 1.0);
+      if (cov > 0)
+        row(j)[i] = blendPixel(row(j)[i], scalePixel(strokecolor, cov));
+    }
+}
+
+// Resizes a sprite drawn for 11x11 mazes to the current tile size
+static void fitSprite(Image &img)
+{
+  if (spriteScale != 1.0)
+    img.zoom(Geometry(max((int)lround(img.columns() * spriteScale), 1),
+                      max((int)lround(img.rows() * spriteScale), 1)));
+}
+
 Line::Line(double x0, double y0, double x1, double y1)
     : data{x0, y0, x1, y1}
 {
@@ -41,6 +419,32 @@ void Line::drawTo(Image &canvas)
   canvas.draw(DrawableLine(gameX(data[0]), gameY(data[1]), gameX(data[2]), gameY(data[3])));
 }
 
+void Line::drawTo(Image &canvas, double zoom, int ox, int oy)
+{
+  canvas.draw(DrawableLine(gameX(data[0]) * zoom - ox, gameY(data[1]) * zoom - oy,
+                           gameX(data[2]) * zoom - ox, gameY(data[3]) * zoom - oy));
+}
+
+void Line::drawTo(Raster &canvas)
+{
+  canvas.drawLine(gameX(data[0]), gameY(data[1]), gameX(data[2]), gameY(data[3]));
+}
+
+void Line::addTo(Scene &scene)
+{
+  scene.addLine(gameX(data[0]), gameY(data[1]), gameX(data[2]), gameY(data[3]), "#000000", strokePx(11));
+}
+
+void Line::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  // Pad for the round-capped stroke of a visible wall
+  const int pad = (int)(strokePx(11) / 2) + 3;
+  x0 = min(gameX(data[0]), gameX(data[2])) - pad;
+  y0 = min(gameY(data[1]), gameY(data[3])) - pad;
+  x1 = max(gameX(data[0]), gameX(data[2])) + pad;
+  y1 = max(gameY(data[1]), gameY(data[3])) + pad;
+}
+
 void Line::visit(IElem *other)
 {
   other->notify(this);
@@ -119,35 +523,90 @@ string Line::writeStatus() const
   return string("wall ") + to_string(data[0]) + " " + to_string(data[1]) + " " + to_string(data[2]) + " " + to_string(data[3]);
 }
 
-TWall::TWall(double x0, double y0, double x1, double y1)
-    : Line(x0, y0, x1, y1), visible(true), framecount(0)
+TWall::TWall(double x0, double y0, double x1, double y1, Game *_game, int _framecount)
+    : Line(x0, y0, x1, y1), visible(true), framecount(_framecount), game(_game)
+{
+}
+
+TWall::TWall(const TWall &tw, Game *_game)
+    : Line(tw), visible(tw.visible), framecount(tw.framecount), game(_game)
 {
 }
 TWall::~TWall() {}
 bool TWall::isvisible() const { return visible; }
 
+int TWall::fadeIndex() const
+{
+  int m = ((double)framecount / ((frame_per_sec * TWALL_DURATION)+1)) * 5;
+  std::cout << "The frame count is: " << framecount << " m is " << m << std::endl;
+  return m;
+}
+
+void TWall::advance()
+{
+  framecount++;
+  if (framecount > (frame_per_sec * TWALL_DURATION))
+    game->removeTWall(this);
+}
+
 void TWall::drawTo(Image &canvas)
 {
   if (visible == true)
   {
-    int m = ((double)framecount / ((frame_per_sec * TWALL_DURATION)+1)) * 5;
-    std::cout << "The frame count is: " << framecount << " m is " << m << std::endl;
-    canvas.strokeWidth(15);
-    canvas.strokeColor(Color(color[m]));
+    canvas.strokeWidth(strokePx(15));
+    canvas.strokeColor(Color(color[fadeIndex()]));
     Line::drawTo(canvas);
-    canvas.strokeWidth(11);
+    canvas.strokeWidth(strokePx(11));
     canvas.strokeColor(Color("#000000"));
-    framecount++;
-    if (framecount > (frame_per_sec * TWALL_DURATION))
-      Game::getGame()->removeTWall(this);
+    advance();
+  }
+}
+
+void TWall::drawTo(Raster &canvas)
+{
+  if (visible == true)
+  {
+    canvas.strokeWidth(strokePx(15));
+    canvas.strokeColor(color[fadeIndex()]);
+    Line::drawTo(canvas);
+    canvas.strokeWidth(strokePx(11));
+    canvas.strokeColor("#000000");
+    advance();
+  }
+}
+
+void TWall::addTo(Scene &scene)
+{
+  if (visible == true)
+  {
+    scene.addLine(gameX(getX0()), gameY(getY0()), gameX(getX1()), gameY(getY1()), color[fadeIndex()], strokePx(15));
+    advance();
   }
 }
 
+void TWall::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  // TWalls use a wider stroke
+  const int pad = (int)((strokePx(15) - strokePx(11)) / 2) + 1;
+  Line::drawBounds(x0, y0, x1, y1);
+  x0 -= pad;
+  y0 -= pad;
+  x1 += pad;
+  y1 += pad;
+}
+
 string TWall::writeStatus() const
 {
   return string("twall ") + to_string(getX0()) + " " + to_string(getY0()) + " " + to_string(getX1()) + " " + to_string(getY1()) + " " + to_string(TWALL_DURATION - (framecount/frame_per_sec));
 }
 
+string TWall::writeState() const
+{
+  ostringstream out;
+  out << setprecision(17) << "twall " << getX0() << " " << getY0() << " " << getX1() << " " << getY1() << " " << framecount;
+  return out.str();
+}
+
 Circle::Circle(double _x, double _y, double _r, double _maxv)
     : x(_x), y(_y), v(0), a(0), maxv(_maxv), r(_r) {}
 Circle::~Circle() {}
@@ -208,6 +667,14 @@ double Circle::maxAngleTo(double x0, double y0) const
   return atan2(y - y0, x0 - x);
 }
 
+void Circle::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  x0 = gameX(x) - spriteHalf;
+  y0 = gameY(y) - spriteHalf;
+  x1 = x0 + 2 * spriteHalf;
+  y1 = y0 + 2 * spriteHalf;
+}
+
 double Circle::getA() const { return a; }
 double Circle::getV() const { return v; }
 double Circle::getX() const { return x; }
@@ -248,37 +715,99 @@ string Home::writeStatus() const
 }
 
 void Home::drawTo(Image &canvas) {}
+void Home::drawTo(Raster &canvas) {}
+void Home::addTo(Scene &scene) {}
+
+void Home::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  x0 = y0 = x1 = y1 = 0;
+}
 
 Flag::Flag(bool _isgreen, double _x, double _y)
     : Circle(_x, _y, 0.42, 0.0),
       framecount(_isgreen ? 0 : 10),
       isgreen(_isgreen),
-      flagimage{}
+      flagimage{}, flagraster{}
 {
+  if (!Game::rendering)
+    return;
   flagimage[0] = Image(_isgreen ? "img/greenflag0.png" : "img/redflag0.png");
   flagimage[1] = Image(_isgreen ? "img/greenflag1.png" : "img/redflag1.png");
+  fitSprite(flagimage[0]);
+  fitSprite(flagimage[1]);
+  if (native_render)
+    for (int i = 0; i < 2; ++i)
+      flagraster[i] = Raster(flagimage[i]);
 }
 
 Flag::~Flag() {}
 
-void Flag::drawTo(Image &canvas)
+int Flag::nextSpriteFrame(double &scale)
 {
-  Image img(flagimage[((framecount + frame_per_sec) % (frame_per_sec + (isgreen ? 3 : 5))) < 4 ? 1 : 0]);
+  const int i = ((framecount + frame_per_sec) % (frame_per_sec + (isgreen ? 3 : 5))) < 4 ? 1 : 0;
+  scale = 1.0;
   if (framecount < 0)
   {
-    if (framecount > -14)
-    {
-      const double p = abs(framecount--) / 14.0;
-      const double f = 1.0 + p * 6.5;
-      img.zoom(Geometry((int)(128 * f), (int)(128 * f)));
-      canvas.composite(img, gameX(getX()) - (int)(64 * f), gameY(getY()) - (int)(64 * f), OverCompositeOp);
-    }
+    if (framecount <= -14)
+      return -1;
+    const double p = abs(framecount--) / 14.0;
+    scale = 1.0 + p * 6.5;
   }
   else
-  {
-    canvas.composite(img, gameX(getX()) - 64, gameY(getY()) - 64, OverCompositeOp);
     ++framecount;
+  return i;
+}
+
+void Flag::drawTo(Image &canvas)
+{
+  double f;
+  const int i = nextSpriteFrame(f);
+  if (i < 0)
+    return;
+  if (f > 1.0)
+  {
+    Image img(flagimage[i]);
+    img.zoom(Geometry((int)(2 * spriteHalf * f), (int)(2 * spriteHalf * f)));
+    canvas.composite(img, gameX(getX()) - (int)(spriteHalf * f), gameY(getY()) - (int)(spriteHalf * f), OverCompositeOp);
+  }
+  else
+    canvas.composite(flagimage[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf, OverCompositeOp);
+}
+
+void Flag::drawTo(Raster &canvas)
+{
+  double f;
+  const int i = nextSpriteFrame(f);
+  if (i < 0)
+    return;
+  if (f > 1.0)
+    canvas.composite(flagraster[i].zoomed((int)(2 * spriteHalf * f), (int)(2 * spriteHalf * f)),
+                     gameX(getX()) - (int)(spriteHalf * f), gameY(getY()) - (int)(spriteHalf * f));
+  else
+    canvas.composite(flagraster[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf);
+}
+
+void Flag::addTo(Scene &scene)
+{
+  double f;
+  const int i = nextSpriteFrame(f);
+  if (i >= 0)
+    scene.addSprite(&flagimage[i], gameX(getX()) - (int)(spriteHalf * f), gameY(getY()) - (int)(spriteHalf * f), f);
+}
+
+void Flag::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  if (framecount <= -14)
+  {
+    x0 = y0 = x1 = y1 = 0;
+    return;
   }
+  // Grows by up to 7.5x while fading out after being captured
+  const double f = framecount < 0 ? 1.0 + (abs(framecount) / 14.0) * 6.5 : 1.0;
+  x0 = gameX(getX()) - (int)(spriteHalf * f);
+  y0 = gameY(getY()) - (int)(spriteHalf * f);
+  x1 = x0 + (int)(2 * spriteHalf * f) + 1;
+  y1 = y0 + (int)(2 * spriteHalf * f) + 1;
 }
 
 void Flag::notify(Circle *circ)
@@ -300,21 +829,48 @@ void Flag::returnBack()
     framecount = 0;
 }
 
+bool Flag::isCaptured() const { return framecount < 0; }
+
+bool Flag::isGreen() const
+{
+  return isgreen;
+}
+
 string Flag::writeStatus() const
 {
   return string(isgreen ? "greenflag" : "redflag") + " " + to_string(getX()) + " " + to_string(getY());
 }
 
+string Flag::writeState() const
+{
+  ostringstream out;
+  out << setprecision(17) << "flag " << getX() << " " << getY() << " " << framecount;
+  return out.str();
+}
+
+void Flag::readState(istream &in)
+{
+  double x, y;
+  in >> x >> y >> framecount;
+  setX(x);
+  setY(y);
+}
+
 Coin::Coin(double _x, double _y)
     : Circle(_x, _y, 0.42, 0.0),
       framecount(rand() % 9), visible(true),
-      coinimage{}
+      coinimage{}, coinraster{}
 {
+  if (!Game::rendering)
+    return;
   Image fullcoinimage = Image("img/coin.png");
   for (int i = 0; i < 8; ++i)
   {
     coinimage[i] = fullcoinimage;
     coinimage[i].crop(Geometry(152, 150, i * 152, 0));
+    fitSprite(coinimage[i]);
+    if (native_render)
+      coinraster[i] = Raster(coinimage[i]);
   }
 }
 
@@ -322,19 +878,44 @@ Coin::~Coin() {}
 
 bool Coin::isvisible() const { return visible; }
 
-void Coin::drawTo(Image &canvas)
+int Coin::nextSpriteFrame()
 {
   if (framecount < 0)
   {
     ++framecount;
+    return -1;
   }
+  visible = true;
+  return (framecount++ / 3) % 8;
+}
+
+void Coin::drawTo(Image &canvas)
+{
+  const int i = nextSpriteFrame();
+  if (i >= 0)
+    canvas.composite(coinimage[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf, OverCompositeOp);
+}
+
+void Coin::drawTo(Raster &canvas)
+{
+  const int i = nextSpriteFrame();
+  if (i >= 0)
+    canvas.composite(coinraster[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf);
+}
+
+void Coin::addTo(Scene &scene)
+{
+  const int i = nextSpriteFrame();
+  if (i >= 0)
+    scene.addSprite(&coinimage[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf);
+}
+
+void Coin::drawBounds(int &x0, int &y0, int &x1, int &y1) const
+{
+  if (framecount < 0)
+    x0 = y0 = x1 = y1 = 0;
   else
-  {
-    Image img(coinimage[((framecount / 3) % 8)]);
-    visible = true;
-    canvas.composite(img, gameX(getX()) - 64, gameY(getY()) - 64, OverCompositeOp);
-    ++framecount;
-  }
+    Circle::drawBounds(x0, y0, x1, y1);
 }
 
 void Coin::notify(Circle *circ)
@@ -342,13 +923,13 @@ void Coin::notify(Circle *circ)
   myerror("flag::notify(Circle*)");
 }
 
-void Coin::captured()
+void Coin::captured(mt19937 &rng, int w, int h)
 {
   if (visible == true)
   {
     visible = false;
-    setX(randomPos());
-    setY(randomPos());
+    setX(randomPos(w, rng));
+    setY(randomPos(h, rng));
     framecount = -90;
   }
 }
@@ -358,92 +939,342 @@ string Coin::writeStatus() const
   return "coin " + to_string(getX()) + " " + to_string(getY());
 }
 
-// Run in each ctor as dedicated thread for communication
-void Robot::readloop(Robot *self)
+string Coin::writeState() const
 {
-  while (self->childout && self->childin)
-  {
-    // Send out observations as fast as they are queued
-    string view;
-    while (self->observations.pop(view))
-    {
-      self->childin << view << endl;
-      view = "";
-    }
+  ostringstream out;
+  out << setprecision(17) << "coin " << getX() << " " << getY() << " " << framecount << " " << visible;
+  return out.str();
+}
 
-    // Expect a single command and queue it
-    string line;
-    if (getline(self->childout, line) && !line.empty())
-      while (!self->commands.push(line))
-        ;
-  }
+void Coin::readState(istream &in)
+{
+  double x, y;
+  in >> x >> y >> framecount >> visible;
+  setX(x);
+  setY(y);
 }
 
-Robot::Robot(string cmd, double _x, double _y, Game *_game, bool isgreen)
-    : Circle(_x, _y, robot_r, robot_maxv),
-      greenbot{}, botframe(0), name(), isgreen(isgreen),
-      tx(_x), ty(_y), homex(_x), homey(_y), game(_game),
-      log(), lognext(0), isFlagCaptured(false), flagcount(0), coincount(0),
-      childout(),total_coin_collected(0),
+Agent::Agent(const string &_cmd)
+    : cmd(_cmd),
+      childout(),
       childin(),
-      proc(cmd.c_str(), std_out > childout, std_in < childin),
+      proc(_cmd.c_str(), std_out > childout, std_in < childin),
       commands(32 * 1024),
       observations(32 * 1024),
-      messenger(readloop, this)
+      cmdus(),
+      sent(0),
+      ready(false),
+      resetting(false),
+      stopping(false),
+      writer(writeloop, this),
+      reader(readloop, this)
 {
-  Image fullgreenbot = Image(isgreen ? "img/greenbot.png" : "img/redbot.png");
-  for (int i = 0; i < 45; ++i)
-  {
-    greenbot[i] = fullgreenbot;
-    greenbot[i].crop(Geometry(128, 128, i * 128, 0));
-  }
-  for (int i = 0; i < log_len; ++i)
-    log.push_back("");
 }
-Robot::~Robot()
+
+Agent::~Agent()
 {
-  childin << "close" << endl;
-  childin.close();
+  stopping = true;
+  writer.join();
+  // Flushing throws if the agent has already exited; the pipe is then closed
+  // by hand, so the stream doesn't try again as it is destroyed
+  try
+  {
+    childin << "close" << endl;
+    childin.close();
+  }
+  catch (const std::exception &)
+  {
+  }
+  childin.pipe().close();
+  std::error_code ec;
+  proc.terminate(ec);
+  reader.join();
   childout.close();
-  proc.terminate();
-  messenger.join();
 }
 
-double Robot::getHomeX() { return homex; };
-double Robot::getHomeY() { return homey; };
-int Robot::getflagCount() { return flagcount; };
-int Robot::getcoinCount() { return coincount; };
-void Robot::setcoinCount(int _coinCount) { coincount = _coinCount; };
-
-vector<string> Robot::getLog() const { return log; }
-
-void Robot::drawTo(Image &canvas)
+// Dedicated thread sending observations as soon as they are queued, or
+// once the agent is ready for them when conflating
+void Agent::writeloop(Agent *self)
+{
+  Trace::nameThread("agent writer: " + self->cmd);
+  // Observations since the last reset, and the latest one not yet written
+  unsigned long long seq = 0;
+  string pending;
+  while (!self->stopping && self->childin)
+  {
+    string view;
+    bool any = false;
+    while (self->observations.pop(view))
+    {
+      any = true;
+      if (view == "reset")
+      {
+        seq = 0;
+        pending = "";
+        self->write(view, false);
+        continue;
+      }
+      ++seq;
+      if (!conflate)
+      {
+        self->write(view, true);
+        continue;
+      }
+      // The maze size is only sent on the first tick, so it must not be dropped
+      string maze = "";
+      if (pending.compare(0, 4, "seq ") == 0)
+      {
+        const size_t first = pending.find('\n') + 1;
+        if (pending.compare(first, 5, "maze ") == 0)
+          maze = pending.substr(first, pending.find('\n', first) + 1 - first);
+      }
+      pending = "seq " + to_string(seq) + "\n" + maze + view;
+    }
+    if (pending != "" && self->caughtUp())
+    {
+      self->write(pending, true);
+      pending = "";
+      any = true;
+    }
+    if (!any)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+}
+
+void Agent::write(const string &text, bool timed)
+{
+  TraceSpan span("agent write");
+  childin << text << endl;
+  if (timed)
+    sent = mytime_us();
+}
+
+bool Agent::caughtUp()
+{
+  // FIONREAD on the write end of a pipe also counts the bytes not yet read
+  int unread = 0;
+  if (ioctl(childin.pipe().native_sink(), FIONREAD, &unread) != 0)
+    return true;
+  return unread == 0;
+}
+
+// Dedicated thread queueing each line the agent writes
+void Agent::readloop(Agent *self)
+{
+  Trace::nameThread("agent reader: " + self->cmd);
+  while (self->childout)
+  {
+    string line;
+    bool read;
+    {
+      TraceSpan span("agent wait");
+      read = getline(self->childout, line) && !line.empty();
+    }
+    if (!read)
+      continue;
+    const bool hello = line.compare(0, 11, "himynameis ") == 0;
+    if (self->resetting && !hello)
+      continue;
+    if (hello)
+    {
+      // Only this thread records latencies, so the last game's are dropped
+      // here, once the agent has acknowledged the reset
+      if (self->resetting)
+        self->cmdus.clear();
+      self->resetting = false;
+      self->ready = true;
+    }
+    // A hello answers no observation, so it isn't timed
+    const unsigned long long t0 = self->sent.exchange(0);
+    if (t0 && !hello)
+      self->cmdus.record(mytime_us() - t0);
+    while (!self->commands.push(line))
+      ;
+  }
+}
+
+const string &Agent::getCmd() const { return cmd; }
+int Agent::getPid() { return proc.id(); }
+
+void Agent::send(const string &view)
+{
+  observations.push(view);
+}
+
+bool Agent::receive(string &line)
+{
+  return commands.pop(line);
+}
+
+bool Agent::isReady() const { return ready; }
+
+bool Agent::isHealthy()
+{
+  std::error_code ec;
+  return ready && proc.running(ec);
+}
+
+void Agent::reset()
+{
+  resetting = true;
+  ready = false;
+  string line;
+  while (commands.pop(line))
+    ;
+  sent = 0;
+  send("reset");
+}
+
+const Histogram &Agent::getCmdLatency() const { return cmdus; }
+
+bool Agent::conflate = false;
+
+map<string, vector<Agent *>> AgentPool::idle;
+bool AgentPool::enabled = false;
+
+Agent *AgentPool::acquire(const string &cmd)
+{
+  vector<Agent *> &warm = idle[cmd];
+  if (!enabled || warm.empty())
+    return new Agent(cmd);
+  Agent *agent = warm.back();
+  warm.pop_back();
+  agent->reset();
+  if (verbose)
+    cout << "Reusing warm agent: " << cmd << endl;
+  return agent;
+}
+
+void AgentPool::release(Agent *agent)
+{
+  if (enabled && agent->isHealthy())
+    idle[agent->getCmd()].push_back(agent);
+  else
+  {
+    if (enabled && verbose)
+      cout << "Recycling agent that exited or never said himynameis: " << agent->getCmd() << endl;
+    delete agent;
+  }
+}
+
+void AgentPool::clear()
+{
+  for (auto &warm : idle)
+    for (Agent *agent : warm.second)
+      delete agent;
+  idle.clear();
+}
+
+Robot::Robot(string cmd, double _x, double _y, Game *_game, bool isgreen)
+    : Circle(_x, _y, robot_r, robot_maxv),
+      greenbot{}, botraster{}, botframe(0), name(), isgreen(isgreen),
+      tx(_x), ty(_y), homex(_x), homey(_y), game(_game),
+      log(), lognext(0), isFlagCaptured(false), flagCaptured(nullptr), flagcount(0), coincount(0),
+      total_coin_collected(0),
+      agent(cmd == "" ? nullptr : AgentPool::acquire(cmd))
+{
+  for (int i = 0; i < log_len; ++i)
+    log.push_back("");
+}
+
+Robot::Robot(const Robot &bot, Game *_game, Flag *_flagCaptured)
+    : Circle(bot),
+      greenbot{}, botraster{}, botframe(bot.botframe), name(bot.name), isgreen(bot.isgreen),
+      tx(bot.tx), ty(bot.ty), homex(bot.homex), homey(bot.homey), game(_game),
+      log(bot.log), lognext(bot.lognext), isFlagCaptured(bot.isFlagCaptured), flagCaptured(_flagCaptured),
+      flagcount(bot.flagcount), coincount(bot.coincount),
+      total_coin_collected(bot.total_coin_collected),
+      agent(nullptr)
+{
+}
+
+void Robot::loadSprites()
+{
+  Image fullgreenbot = Image(isgreen ? "img/greenbot.png" : "img/redbot.png");
+  for (int i = 0; i < 45; ++i)
+  {
+    greenbot[i] = fullgreenbot;
+    greenbot[i].crop(Geometry(128, 128, i * 128, 0));
+    fitSprite(greenbot[i]);
+    if (native_render)
+      botraster[i] = Raster(greenbot[i]);
+  }
+}
+
+bool Robot::isReady() const { return agent->isReady(); }
+int Robot::getAgentPid() { return agent->getPid(); }
+
+Robot::~Robot()
+{
+  if (agent)
+    AgentPool::release(agent);
+}
+
+double Robot::getHomeX() { return homex; };
+double Robot::getHomeY() { return homey; };
+int Robot::getflagCount() { return flagcount; };
+int Robot::getcoinCount() { return coincount; };
+void Robot::setcoinCount(int _coinCount) { coincount = _coinCount; };
+
+vector<string> Robot::getLog() const { return log; }
+
+Flag *Robot::getCarriedFlag() const { return isFlagCaptured ? flagCaptured : nullptr; }
+
+const Histogram &Robot::getCmdLatency() const { return agent->getCmdLatency(); }
+
+int Robot::nextSpriteFrame(bool &flop)
 {
   ++botframe;
-  Image sframe;
+  flop = false;
   // Down, Right, Up, Left
   if (-1 * M_PI / 4 <= getA() && getA() < M_PI / 4)
   {
     // Right
-    sframe = greenbot[(botframe % 12) / 2];
+    return (botframe % 12) / 2;
   }
   else if (M_PI / 4 <= getA() && getA() < 3 * M_PI / 4)
   {
     // Down
-    sframe = greenbot[((botframe % 10) / 2 < 4) ? 14 : 15];
+    return ((botframe % 10) / 2 < 4) ? 14 : 15;
   }
   else if (3 * M_PI / 4 <= getA() || getA() < -3 * M_PI / 4)
   {
     // Left
-    sframe = greenbot[(botframe % 12) / 2];
-    sframe.flop();
+    flop = true;
+    return (botframe % 12) / 2;
   }
-  else if (-3 * M_PI / 4 <= getA() && getA() < -1 * M_PI / 4)
+  // Up
+  return ((botframe % 10) / 2 < 4) ? 14 : 15;
+}
+
+void Robot::drawTo(Image &canvas)
+{
+  bool flop;
+  Image sframe = greenbot[nextSpriteFrame(flop)];
+  if (flop)
+    sframe.flop();
+  canvas.composite(sframe, gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf, OverCompositeOp);
+}
+
+void Robot::drawTo(Raster &canvas)
+{
+  bool flop;
+  const int i = nextSpriteFrame(flop);
+  if (flop)
   {
-    // Up
-    sframe = greenbot[((botframe % 10) / 2 < 4) ? 14 : 15];
+    Raster sframe = botraster[i];
+    sframe.flop();
+    canvas.composite(sframe, gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf);
   }
-  canvas.composite(sframe, gameX(getX()) - 64, gameY(getY()) - 64, OverCompositeOp);
+  else
+    canvas.composite(botraster[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf);
+}
+
+void Robot::addTo(Scene &scene)
+{
+  bool flop;
+  const int i = nextSpriteFrame(flop);
+  scene.addSprite(&greenbot[i], gameX(getX()) - spriteHalf, gameY(getY()) - spriteHalf, 1.0, flop);
 }
 
 void Robot::move()
@@ -478,16 +1309,18 @@ void Robot::move()
 
 void Robot::play(string view)
 {
+  TraceSpan span("Robot::play");
+
   // Simulate movement
   move();
 
   // Send current sense data to client process
-  observations.push(view);
+  agent->send(view);
 
   // Process a single command per timestep
   // (except for non-behavioral commands, which do not count)
   string cmd, displaycmd;
-  while (commands.pop(cmd))
+  while (agent->receive(cmd))
   {
     if (cmd.substr(0, 8) == "comment ")
       displaycmd = cmd.substr(8, cmd.size() - 8);
@@ -504,80 +1337,85 @@ void Robot::play(string view)
     log[lognext] = "";
     log[(lognext + 1) % log_len] = "";
 
-    // Process command
-    if (cmd.substr(0, 7) == "toward ")
+    // Read another rapidly instead of waiting for next timestep
+    // if the command was non-behavioral
+    if (runCommand(cmd))
+      break;
+  }
+}
+
+bool Robot::runCommand(const string &cmd)
+{
+  if (cmd.substr(0, 7) == "toward ")
+  {
+    // Update current target position (tx,ty) at a "toward" command
+    string data = cmd.substr(7, cmd.size() - 7);
+    int pos = data.find(' ');
+    tx = stod(data.substr(0, pos));
+    ty = stod(data.substr(pos + 1, data.size() - 1 - pos));
+  }
+  else if (cmd.substr(0, 6) == "block ")
+  {
+    string data = cmd.substr(6, cmd.size() - 6);
+    std::vector<std::string> result;
+    boost::split(result, data, boost::is_any_of(" "));
+    int _x = stoi(result[0]);
+    int _y = stoi(result[1]);
+    string dirn = result[2];
+    double x0, y0, x1, y1;
+    if (dirn == "l") // left
     {
-      // Update current target position (tx,ty) at a "toward" command
-      string data = cmd.substr(7, cmd.size() - 7);
-      int pos = data.find(' ');
-      tx = stod(data.substr(0, pos));
-      ty = stod(data.substr(pos + 1, data.size() - 1 - pos));
+      x0 = _x;
+      y0 = _y;
+      x1 = _x;
+      y1 = _y + 1;
     }
-    else if (cmd.substr(0, 6) == "block ")
+    else if (dirn == "r") // right
     {
-      string data = cmd.substr(6, cmd.size() - 6);
-      std::vector<std::string> result;
-      boost::split(result, data, boost::is_any_of(" "));
-      int _x = stoi(result[0]);
-      int _y = stoi(result[1]);
-      string dirn = result[2];
-      double x0, y0, x1, y1;
-      if (dirn == "l") // left
-      {
-        x0 = _x;
-        y0 = _y;
-        x1 = _x;
-        y1 = _y + 1;
-      }
-      else if (dirn == "r") // right
-      {
-        x0 = _x + 1;
-        y0 = _y;
-        x1 = _x + 1;
-        y1 = _y + 1;
-      }
-      else if (dirn == "u") // up
-      {
-        x0 = _x;
-        y0 = _y;
-        x1 = _x + 1;
-        y1 = _y;
-      }
-      else if (dirn == "d") // down
-      {
-        x0 = _x;
-        y0 = _y + 1;
-        x1 = _x + 1;
-        y1 = _y + 1;
-      }
-      else
-        myerror("Invalid direction for twall");
-      // should be in the same tile
-      std::cout << "getX(): " << floor(getX()) << " x0: " << x0 << " getY(): " << floor(getY()) << " y0: " << y0 << std::endl;
-      if (coincount >= TWALL_COST && floor(getX())==_x && floor(getY())==_y && Game::getGame()->isWall(x0, y0, x1, y1) == false)
-      {
-        game->addTWall(x0, y0, x1, y1);
-        coincount -= TWALL_COST;
-      }
+      x0 = _x + 1;
+      y0 = _y;
+      x1 = _x + 1;
+      y1 = _y + 1;
+    }
+    else if (dirn == "u") // up
+    {
+      x0 = _x;
+      y0 = _y;
+      x1 = _x + 1;
+      y1 = _y;
+    }
+    else if (dirn == "d") // down
+    {
+      x0 = _x;
+      y0 = _y + 1;
+      x1 = _x + 1;
+      y1 = _y + 1;
     }
     else
+      myerror("Invalid direction for twall");
+    // should be in the same tile
+    std::cout << "getX(): " << floor(getX()) << " x0: " << x0 << " getY(): " << floor(getY()) << " y0: " << y0 << std::endl;
+    if (coincount >= TWALL_COST && floor(getX())==_x && floor(getY())==_y && game->isWall(x0, y0, x1, y1) == false)
     {
-      // Non-behavioral commands
-      if (cmd.substr(0, 11) == "himynameis ")
-        name = cmd.substr(11, cmd.size() - 11);
-      else if (cmd.substr(0, 8) == "comment ")
-      {
-        if (!verbose) // if not otherwise printed
-          cout << name << ": " << cmd.substr(8, cmd.size() - 8) << endl;
-      }
-      else
-        myerror(string("Unrecognized command: ") + cmd);
-      // Read another rapidly instead of waiting for next timestep:
-      cmd = "";
-      continue;
+      game->addTWall(x0, y0, x1, y1);
+      coincount -= TWALL_COST;
+    }
+  }
+  else
+  {
+    // Non-behavioral commands
+    if (cmd.substr(0, 11) == "himynameis ")
+      name = cmd.substr(11, cmd.size() - 11);
+    else if (cmd.substr(0, 8) == "comment ")
+    {
+      if (!verbose) // if not otherwise printed
+        cout << name << ": " << cmd.substr(8, cmd.size() - 8) << endl;
     }
-    break;
+    else
+      myerror(string("Unrecognized command: ") + cmd);
+    return false;
   }
+  return true;
 }
 
 void Robot::notify(Circle *flag_or_home)
@@ -585,7 +1423,8 @@ void Robot::notify(Circle *flag_or_home)
   Flag *flag = dynamic_cast<Flag *>(flag_or_home);
   Home *home = dynamic_cast<Home *>(flag_or_home);
   Coin *coin = dynamic_cast<Coin *>(flag_or_home);
-  if (flag && !(flag->getX() == homex && flag->getY() == homey) && isFlagCaptured == false)
+  // A flag stays put while carried, so one another robot already has is skipped
+  if (flag && !(flag->getX() == homex && flag->getY() == homey) && isFlagCaptured == false && !flag->isCaptured())
   {
     isFlagCaptured = true;
     flagCaptured = flag;
@@ -601,7 +1440,7 @@ void Robot::notify(Circle *flag_or_home)
   {
     coincount++;
     total_coin_collected++;
-    coin->captured();
+    coin->captured(game->getRng(), game->getTileW(), game->getTileH());
   }
 }
 
@@ -612,6 +1451,35 @@ string Robot::writeStatus() const
   return string("opponent ") + to_string(getX()) + " " + to_string(getY());
 }
 
+string Robot::writeState(const vector<IElem *> &objects) const
+{
+  const int flag = isFlagCaptured ? find(objects.begin(), objects.end(), flagCaptured) - objects.begin() : -1;
+  ostringstream out;
+  out << setprecision(17) << "robot " << getX() << " " << getY() << " " << getV() << " " << getA() << " "
+      << tx << " " << ty << " " << botframe << " " << coincount << " " << flagcount << " "
+      << total_coin_collected << " " << flag << " " << name;
+  return out.str();
+}
+
+void Robot::readState(istream &in, const vector<IElem *> &objects)
+{
+  double x, y, v, a;
+  int flag;
+  in >> x >> y >> v >> a >> tx >> ty >> botframe >> coincount >> flagcount >> total_coin_collected >> flag;
+  myassert(!in.fail() && flag < (int)objects.size(), "Bad robot in game state");
+  setX(x);
+  setY(y);
+  setV(v);
+  setA(a);
+  isFlagCaptured = flag >= 0;
+  flagCaptured = isFlagCaptured ? dynamic_cast<Flag *>(objects[flag]) : nullptr;
+  myassert(!isFlagCaptured || flagCaptured, "Robot in game state carries something other than a flag");
+  // The name is the rest of the line, and may be empty
+  in.get();
+  getline(in, name);
+  in.clear();
+}
+
 LineAngle::LineAngle(Line *_line, double minAngle, double maxAngle)
     : line(_line), minAngle(minAngle), maxAngle(maxAngle) {}
 
@@ -622,14 +1490,50 @@ string LineAngle::writeStatus() const
   return "lineangle " + line->writeStatus() + " " + to_string(minAngle) + " " + to_string(maxAngle);
 }
 
+RenderTier::RenderTier(bool _direct, double _scale, int _framestep)
+    : direct(_direct), scale(_scale), framestep(_framestep)
+{
+}
+
+RenderTier RenderTier::byName(const string &name)
+{
+  if (name == "full")
+    return RenderTier(false, 1.0, 1);
+  else if (name == "direct")
+    return RenderTier(true, 1.0, 1);
+  else if (name == "preview")
+    return RenderTier(true, 2.0 / 3.0, 2);
+  myerror("Unknown render quality: " + name);
+  return RenderTier();
+}
+
 Game *Game::game_singleton = nullptr;
-Game::RenderMessage::RenderMessage(Image *_frame,
+bool Game::renderthreads = true;
+#ifdef no_render
+bool Game::rendering = false;
+#else
+bool Game::rendering = true;
+#endif
+int Game::agenttimeout = agent_ready_ms;
+string Game::metricspath = "metrics";
+int Game::metricsevery = 0;
+string Game::checkpointpath = "checkpoint.state";
+int Game::checkpointevery = 0;
+string Game::restorepath = "";
+int Game::rays = 0;
+map<string, MazeData> Game::mazes;
+map<string, Image> Game::backgrounds;
+unsigned long long Game::backgroundhash = 0;
+Game::RenderMessage::RenderMessage(Image *_frame, shared_ptr<Raster> _rframe, Scene *_scene,
                                    int _x0, int _y0, int _x1, int _y1,
-                                   string nm0, string nm1,
+                                   string nm0, int fl0, int cn0,
+                                   string nm1, int fl1, int cn1,
                                    vector<string> _log0, vector<string> _log1)
     : frame(_frame), screen(0),
+      rframe(_rframe), rscreen(0), scene(_scene),
       x0(_x0), y0(_y0), x1(_x1), y1(_y1),
-      name0(nm0), name1(nm1),
+      name0(nm0), flags0(fl0), coins0(cn0),
+      name1(nm1), flags1(fl1), coins1(cn1),
       log0(_log0), log1(_log1)
 {
 }
@@ -639,28 +1543,96 @@ Game::RenderMessage::~RenderMessage()
     delete frame;
   if (screen)
     delete screen;
+  if (rscreen)
+    delete rscreen;
+  if (scene)
+    delete scene;
+}
+
+Game::TextCache::TextCache()
+    : strips(), framecount(0)
+{
+}
+Game::TextCache::~TextCache() {}
+
+void Game::TextCache::drawTo(Image &canvas, const string &text, int pointsize,
+                             int w, int h, int x, int y)
+{
+  if (text.empty())
+    return;
+  const string key = to_string(pointsize) + " " + to_string(w) + " " + to_string(h) + " " + text;
+  auto it = strips.find(key);
+  if (it == strips.end())
+  {
+    // Only a line of text not seen recently needs to be rasterized
+    Strip strip;
+    strip.img = Image(Geometry(w, h), Color("transparent"));
+    strip.img.font("helvetica");
+    strip.img.strokeColor(Color("black"));
+    strip.img.fillColor(Color("black"));
+    strip.img.fontPointsize(pointsize);
+    strip.img.annotate(text, Geometry(w, h, 0, 0), WestGravity);
+    it = strips.insert(make_pair(key, strip)).first;
+  }
+  it->second.lastframe = framecount;
+  canvas.composite(it->second.img, x, y, OverCompositeOp);
+}
+
+void Game::TextCache::nextFrame()
+{
+  if (strips.size() > textcache_max)
+    for (auto it = strips.begin(); it != strips.end();)
+      if (it->second.lastframe < framecount)
+        it = strips.erase(it);
+      else
+        ++it;
+  ++framecount;
 }
 
 // Stage 0: Initial zoom
 void Game::renderloop0(Game *self)
 {
+  Trace::nameThread("render0");
+  CpuBudget::pinThread(CpuBudget::render);
   int framecount = 0;
-  while (framecount < framelimit)
+  Scene::SpriteCache sprites;
+  while (framecount < self->renderlimit)
   {
     // Handle a RenderMessage (first of two phases):
     //   Setup a new 1080p image with scaled map, and then pass to renderloop1
     RenderMessage *msg;
     if (self->to_renderer[0]->pop(msg))
     {
+      TraceSpan span("frame", framecount);
+      const unsigned long long t0 = mytime_us();
+      self->queuedepth[0].record(self->to_renderer[0]->read_available() + 1);
       // This thread builds a 1080p image and scales down the large image
       // msg->screen = new Image(Geometry(1920, 1080), Color("#eeeeee"));
-      msg->screen = new Image(self->bgimage);
-      msg->screen->crop(Geometry(1920, 1080, 0, 0));
-      Image big(*msg->frame);
-      big.zoom(Geometry(1080, 1080));
-      msg->screen->composite(big, 0, 0, OverCompositeOp);
+      const int mainsz = self->ui(1080);
+      if (msg->scene)
+      {
+        // Or draws the main view at its final size
+        msg->screen = new Image(self->bgimage);
+        Image view(self->mainmaze);
+        msg->scene->drawTo(view, self->mainZoom(), 0, 0, sprites);
+        msg->screen->composite(view, 0, 0, OverCompositeOp);
+      }
+      else if (msg->rframe)
+      {
+        msg->rscreen = new Raster(self->bgraster);
+        msg->rframe->resampleTo(*msg->rscreen, 0, 0, renderW, renderH, 0, 0, mainsz, mainsz);
+      }
+      else
+      {
+        msg->screen = new Image(self->bgimage);
+        msg->screen->crop(Geometry(self->ui(1920), mainsz, 0, 0));
+        Image big(*msg->frame);
+        big.zoom(Geometry(mainsz, mainsz));
+        msg->screen->composite(big, 0, 0, OverCompositeOp);
+      }
 
       // Remaining work is pipelined:
+      self->stageus[0].record(mytime_us() - t0);
       while (!self->to_renderer[1]->push(msg))
         ;
       framecount++;
@@ -673,26 +1645,55 @@ void Game::renderloop0(Game *self)
 // Stage 1: Render Focus 0
 void Game::renderloop1(Game *self)
 {
+  Trace::nameThread("render1");
+  CpuBudget::pinThread(CpuBudget::render);
   int framecount = 0;
-  Image black(Geometry(dsz + 6, dsz + 6), Color("black"));
-  while (framecount < framelimit)
+  const int fsz = self->ui(dsz);
+  Image black(Geometry(fsz + 6, fsz + 6), Color("black"));
+  Scene::SpriteCache sprites;
+  while (framecount < self->renderlimit)
   {
     // Finish processing a RenderMessage
     RenderMessage *msg;
     if (self->to_renderer[1]->pop(msg))
     {
-      Image focus0(*msg->frame);
-      // copy frame, crop a csz*csz chunk, then scale it down
-      focus0.crop(Geometry(csz, csz,
-                           max(csz / 2, min(msg->x0, renderW - csz / 2)) - csz / 2,
-                           max(csz / 2, min(msg->y0, renderH - csz / 2)) - csz / 2));
-      focus0.zoom(Geometry(dsz, dsz));
-      // Add a (+3 in a directions) black border for both foci
-      msg->screen->composite(black, 1080 + 7 - 3, 7 - 3, OverCompositeOp);
-      msg->screen->composite(black, 1920 - dsz - 7 - 3, 1080 - dsz - 7 - 3, OverCompositeOp);
-      msg->screen->composite(focus0, 1080 + 7, 7, OverCompositeOp);
+      TraceSpan span("frame", framecount);
+      const unsigned long long t0 = mytime_us();
+      self->queuedepth[1].record(self->to_renderer[1]->read_available() + 1);
+      const int cx = max(csz / 2, min(msg->x0, renderW - csz / 2)) - csz / 2;
+      const int cy = max(csz / 2, min(msg->y0, renderH - csz / 2)) - csz / 2;
+      if (msg->rframe)
+      {
+        msg->rscreen->fill(self->ui(1080 + 7) - 3, self->ui(7) - 3, fsz + 6, fsz + 6, 0xff000000);
+        msg->rscreen->fill(self->ui(1920 - dsz - 7) - 3, self->ui(1080 - dsz - 7) - 3, fsz + 6, fsz + 6, 0xff000000);
+        msg->rframe->resampleTo(*msg->rscreen, cx, cy, csz, csz, self->ui(1080 + 7), self->ui(7), fsz, fsz);
+      }
+      else
+      {
+        Image focus0;
+        if (msg->scene)
+        {
+          // Draw just the focus square at its final size
+          const double z = self->focusZoom();
+          focus0 = Image(Geometry(fsz, fsz), Color("white"));
+          focus0.composite(self->focusmaze, -(int)lround(cx * z), -(int)lround(cy * z), CopyCompositeOp);
+          msg->scene->drawTo(focus0, z, lround(cx * z), lround(cy * z), sprites);
+        }
+        else
+        {
+          focus0 = *msg->frame;
+          // copy frame, crop a csz*csz chunk, then scale it down
+          focus0.crop(Geometry(csz, csz, cx, cy));
+          focus0.zoom(Geometry(fsz, fsz));
+        }
+        // Add a (+3 in a directions) black border for both foci
+        msg->screen->composite(black, self->ui(1080 + 7) - 3, self->ui(7) - 3, OverCompositeOp);
+        msg->screen->composite(black, self->ui(1920 - dsz - 7) - 3, self->ui(1080 - dsz - 7) - 3, OverCompositeOp);
+        msg->screen->composite(focus0, self->ui(1080 + 7), self->ui(7), OverCompositeOp);
+      }
 
       // Remaining work is pipelined:
+      self->stageus[1].record(mytime_us() - t0);
       while (!self->to_renderer[2]->push(msg))
         ;
       framecount++;
@@ -705,22 +1706,47 @@ void Game::renderloop1(Game *self)
 // Stage 2: Render Focus 1
 void Game::renderloop2(Game *self)
 {
+  Trace::nameThread("render2");
+  CpuBudget::pinThread(CpuBudget::render);
   int framecount = 0;
-  while (framecount < framelimit)
+  const int fsz = self->ui(dsz);
+  Scene::SpriteCache sprites;
+  while (framecount < self->renderlimit)
   {
     // Finish processing a RenderMessage
     RenderMessage *msg;
     if (self->to_renderer[2]->pop(msg))
     {
+      TraceSpan span("frame", framecount);
+      const unsigned long long t0 = mytime_us();
+      self->queuedepth[2].record(self->to_renderer[2]->read_available() + 1);
       // Copy, crop, and overlay just focus 1
-      Image focus1(*msg->frame);
-      focus1.crop(Geometry(csz, csz,
-                           max(csz / 2, min(msg->x1, renderW - csz / 2)) - csz / 2,
-                           max(csz / 2, min(msg->y1, renderH - csz / 2)) - csz / 2));
-      focus1.zoom(Geometry(dsz, dsz));
-      msg->screen->composite(focus1, 1920 - dsz - 7, 1080 - dsz - 7, OverCompositeOp);
+      const int cx = max(csz / 2, min(msg->x1, renderW - csz / 2)) - csz / 2;
+      const int cy = max(csz / 2, min(msg->y1, renderH - csz / 2)) - csz / 2;
+      if (msg->rframe)
+        msg->rframe->resampleTo(*msg->rscreen, cx, cy, csz, csz,
+                                self->ui(1920 - dsz - 7), self->ui(1080 - dsz - 7), fsz, fsz);
+      else
+      {
+        Image focus1;
+        if (msg->scene)
+        {
+          const double z = self->focusZoom();
+          focus1 = Image(Geometry(fsz, fsz), Color("white"));
+          focus1.composite(self->focusmaze, -(int)lround(cx * z), -(int)lround(cy * z), CopyCompositeOp);
+          msg->scene->drawTo(focus1, z, lround(cx * z), lround(cy * z), sprites);
+        }
+        else
+        {
+          focus1 = *msg->frame;
+          focus1.crop(Geometry(csz, csz, cx, cy));
+          focus1.zoom(Geometry(fsz, fsz));
+        }
+        msg->screen->composite(focus1, self->ui(1920 - dsz - 7), self->ui(1080 - dsz - 7), OverCompositeOp);
+      }
 
       // Remaining work goes to annotation stage:
+      self->stageus[2].record(mytime_us() - t0);
       while (!self->to_renderer[3]->push(msg))
         ;
       framecount++;
@@ -733,81 +1759,86 @@ void Game::renderloop2(Game *self)
 // Stage 3: Render annotations and write to file
 void Game::renderloop3(Game *self)
 {
+  Trace::nameThread("render3");
+  CpuBudget::pinThread(CpuBudget::render);
   int framecount = 0;
-  while (framecount < framelimit)
+  TextCache text;
+  auto ui = [self](double v) { return self->ui(v); };
+
+  // Scoreboard icons are the same every frame
+  Image greenflag("img/greenflag0.png");
+  greenflag.resize(Geometry(ui(50), ui(50)));
+  Image redflag("img/redflag0.png");
+  redflag.resize(Geometry(ui(50), ui(50)));
+  Image coin("img/coin.png");
+  coin.crop(Geometry(152, 150, 0, 0));
+  coin.resize(Geometry(ui(60), ui(60)));
+
+  while (framecount < self->renderlimit)
   {
     // Finish processing a RenderMessage
     RenderMessage *msg;
     if (self->to_renderer[3]->pop(msg))
     {
-      // Add text annotations
-      msg->screen->font("helvetica");
-      msg->screen->strokeColor(Color("black"));
-      msg->screen->fillColor(Color("black"));
+      TraceSpan span("frame", framecount);
+      const unsigned long long t0 = mytime_us();
+      self->queuedepth[3].record(self->to_renderer[3]->read_available() + 1);
+      // Native frames are handed to GraphicsMagick from here on for text
+      if (msg->rscreen)
+      {
+        msg->screen = new Image(msg->rscreen->toImage());
+        delete msg->rscreen;
+        msg->rscreen = 0;
+        msg->rframe.reset();
+      }
 
-      vector<string> bot0_scores;
-      vector<string> bot1_scores;
-      boost::split(bot0_scores, msg->name0, boost::is_any_of(" "));
-      boost::split(bot1_scores, msg->name1, boost::is_any_of(" "));
       // Names
-      msg->screen->fontPointsize(40);
-      msg->screen->annotate(bot0_scores.at(0).substr(0,20),
-                            Geometry(1920 - 1080 - 15, 50, 1080 + 7, dsz + 15),
-                            WestGravity);
-      msg->screen->annotate(bot1_scores.at(0).substr(0,20),
-                            Geometry(1920 - 1080 - 15, 50, 1080 + 7, dsz + 15 + 49),
-                            WestGravity);
-      // 1080 + 7 + 10* (bot0_scores.at(0).length())
-      // int flag_end0 = 1080 + dsz + 21 * (bot0_scores.at(0).length()) + 10;
-      int flag_end0 = 1080 + 1.3 * dsz;
-      // int flag_end1 = 1080 + 21 * (bot1_scores.at(0).length()) + 10;
-      int flag_end1 = 1080 + 1.3 * dsz;
-      Image greenflag("img/greenflag0.png");
-      greenflag.resize(Geometry(50, 50));
-      msg->screen->composite(greenflag, flag_end0, dsz + 15, OverCompositeOp);
-      Image redflag("img/redflag0.png");
-      redflag.resize(Geometry(50, 50));
-      msg->screen->composite(redflag, flag_end1, dsz + 15 + 49, OverCompositeOp);
+      text.drawTo(*msg->screen, msg->name0.substr(0, 20), ui(40),
+                  ui(1920 - 1080 - 15), ui(50), ui(1080 + 7), ui(dsz + 15));
+      text.drawTo(*msg->screen, msg->name1.substr(0, msg->flags1 < 0 ? 40 : 20), ui(40),
+                  ui(1920 - 1080 - 15), ui(50), ui(1080 + 7), ui(dsz + 15 + 49));
 
       // Flags
-      msg->screen->fontPointsize(40);
-      msg->screen->annotate(bot0_scores.at(1),
-                            Geometry(1920 - 1080 - 15, 50, flag_end0 + 55, dsz + 15),
-                            WestGravity);
-      msg->screen->annotate(bot1_scores.at(1),
-                            Geometry(1920 - 1080 - 15, 50, flag_end1 + 55, dsz + 15 + 49),
-                            WestGravity);
-
-      int coin_end0 = flag_end0 + 55 + 25 * 2;
-      // int coin_end1 = flag_end1 + 55 + 21 * (bot1_scores.at(1).length());
-      int coin_end1 = flag_end1 + 55 + 25 * 2;
-      Image coin("img/coin.png");
-      coin.crop(Geometry(152, 150, 0, 0));
-      coin.resize(Geometry(60, 60));
-      msg->screen->composite(coin, coin_end0, dsz + 15, OverCompositeOp);
-      msg->screen->composite(coin, coin_end1, dsz + 15 + 49, OverCompositeOp);
+      const double flag_end = 1080 + (int)(1.3 * dsz);
+      if (msg->flags0 >= 0)
+      {
+        msg->screen->composite(greenflag, ui(flag_end), ui(dsz + 15), OverCompositeOp);
+        text.drawTo(*msg->screen, to_string(msg->flags0), ui(40),
+                    ui(1920 - 1080 - 15), ui(50), ui(flag_end + 55), ui(dsz + 15));
+      }
+      if (msg->flags1 >= 0)
+      {
+        msg->screen->composite(redflag, ui(flag_end), ui(dsz + 15 + 49), OverCompositeOp);
+        text.drawTo(*msg->screen, to_string(msg->flags1), ui(40),
+                    ui(1920 - 1080 - 15), ui(50), ui(flag_end + 55), ui(dsz + 15 + 49));
+      }
 
       // Coins
-      msg->screen->fontPointsize(40);
-      msg->screen->annotate(bot0_scores.at(2),
-                            Geometry(1920 - 1080 - 15, 50, coin_end0 + 55, dsz + 15),
-                            WestGravity);
-      msg->screen->annotate(bot1_scores.at(2),
-                            Geometry(1920 - 1080 - 15, 50, coin_end1 + 55, dsz + 15 + 49),
-                            WestGravity);
+      const double coin_end = flag_end + 55 + 25 * 2;
+      if (msg->coins0 >= 0)
+      {
+        msg->screen->composite(coin, ui(coin_end), ui(dsz + 15), OverCompositeOp);
+        text.drawTo(*msg->screen, to_string(msg->coins0), ui(40),
+                    ui(1920 - 1080 - 15), ui(50), ui(coin_end + 55), ui(dsz + 15));
+      }
+      if (msg->coins1 >= 0)
+      {
+        msg->screen->composite(coin, ui(coin_end), ui(dsz + 15 + 49), OverCompositeOp);
+        text.drawTo(*msg->screen, to_string(msg->coins1), ui(40),
+                    ui(1920 - 1080 - 15), ui(50), ui(coin_end + 55), ui(dsz + 15 + 49));
+      }
 
       // Logs
-      msg->screen->fontPointsize(30);
       for (int i = 0; i < msg->log0.size(); ++i)
-        msg->screen->annotate(msg->log0[i],
-                              Geometry(1920 - 1080 - 15 * 3 - dsz, 30, 1080 + dsz + 15 * 2 - 10, 5 + i * 30),
-                              WestGravity);
+        text.drawTo(*msg->screen, msg->log0[i], ui(30),
+                    ui(1920 - 1080 - 15 * 3 - dsz), ui(30), ui(1080 + dsz + 15 * 2 - 10), ui(5 + i * 30));
       for (int i = 0; i < msg->log1.size(); ++i)
-        msg->screen->annotate(msg->log1[i],
-                              Geometry(1920 - 1080 - 15, 30, 1080 + 7, dsz + 15 + 120 + i * 30),
-                              WestGravity);
+        text.drawTo(*msg->screen, msg->log1[i], ui(30),
+                    ui(1920 - 1080 - 15), ui(30), ui(1080 + 7), ui(dsz + 15 + 120 + i * 30));
+      text.nextFrame();
 
       // Remaining work goes to last stage for PNG encoding
+      self->stageus[3].record(mytime_us() - t0);
       while (!self->to_renderer[4]->push(msg));
       framecount++;
     }
@@ -819,14 +1850,16 @@ void Game::renderloop3(Game *self)
 // Stage 4: Write to file as compressed PNG
 void Game::renderloop4(Game *self)
 {
+  Trace::nameThread("render4");
+  CpuBudget::pinThread(CpuBudget::render);
   int framecount = 0;
-  while (framecount < framelimit)
+  while (framecount < self->renderlimit)
   {
     if (!self->to_renderer[4]->empty())
     {
       // Approximate progress to std::cout
-      const int p0 = 5 * (int)((framecount / (0.0 + framelimit)) * 20);
-      const int p1 = 5 * (int)(((framecount + 1) / (0.0 + framelimit)) * 20);
+      const int p0 = 5 * (int)((framecount / (0.0 + self->renderlimit)) * 20);
+      const int p1 = 5 * (int)(((framecount + 1) / (0.0 + self->renderlimit)) * 20);
       if (p0 != p1)
         cout << "Rendering is now " << p1 << "% complete" << endl;
 
@@ -834,12 +1867,16 @@ void Game::renderloop4(Game *self)
       RenderMessage *msg;
       if (self->to_renderer[4]->pop(msg))
       {
+        TraceSpan span("frame", framecount);
+        const unsigned long long t0 = mytime_us();
+        self->queuedepth[4].record(self->to_renderer[4]->read_available() + 1);
         // Write it out to disk
         string countstr = to_string(framecount);
         while (countstr.size() < 7)
           countstr = "0" + countstr;
         msg->screen->write(string("out/frame") + countstr + string(".png"));
 
+        self->stageus[4].record(mytime_us() - t0);
         delete msg;
         framecount++;
       }
@@ -849,117 +1886,1308 @@ void Game::renderloop4(Game *self)
   }
 }
 
-void Game::renderMazeRow(int off, promise<Image *> &resp, Game *self)
+int Game::ui(double v) const
+{
+  return (int)lround(v * tier.scale);
+}
+
+double Game::mainZoom() const
 {
+  return ui(1080) / (double)renderW;
+}
+
+double Game::focusZoom() const
+{
+  return ui(dsz) / (double)csz;
+}
+
+void Game::renderMazeRow(int off, double zoom, promise<Image *> &resp, Game *self)
+{
+  CpuBudget::pinThread(CpuBudget::render);
   auto &walls = self->walls;
-  Image *img = new Image(Geometry(renderW, renderH), Color("transparent"));
-  img->strokeWidth(5);
+  const int tileW = self->tileW, tileH = self->tileH;
+  Image *img = new Image(Geometry(lround(renderW * zoom), lround(renderH * zoom)), Color("transparent"));
+  img->strokeWidth(strokePx(5) * zoom);
   img->strokeColor(Color("#909090"));
   img->strokeLineCap(RoundCap);
   for (int y = off; y < tileH + 1; y += 3)
     for (int x = 0; x < tileW + 1; ++x)
-      for (IElem *wall : Walls(x, y))
-        wall->drawTo(*img);
+      for (Line *wall : Walls(x, y))
+        wall->drawTo(*img, zoom, 0, 0);
   resp.set_value(img);
 }
 
-void Game::renderMaze()
+string Game::mazeCachePath(double zoom) const
+{
+  // Anything that changes the drawn walls belongs in the key
+  const string settings = to_string(mazecache_version) + " " + to_string(zoom) + " " +
+                          to_string(renderW) + " " + to_string(renderH) + " " +
+                          to_string(tileW) + " " + to_string(tileH) + " 5 #909090";
+  stringstream key;
+  key << hex << hashBytes(settings, mazehash);
+  return string(mazecache_dir) + key.str() + ".rgba";
+}
+
+bool Game::readMazeCache(Image &target, const string &path)
+{
+  ifstream file(path, ios::binary);
+  string magic;
+  int w = 0, h = 0;
+  if (!(file >> magic >> w >> h) || magic != "MAZEBG" || w <= 0 || h <= 0)
+    return false;
+  file.get(); // newline after the header
+  vector<char> data((size_t)w * h * 4);
+  if (!file.read(data.data(), data.size()))
+    return false;
+  target = Image(w, h, "RGBA", CharPixel, data.data());
+  return true;
+}
+
+void Game::writeMazeCache(const Image &img, const string &path)
+{
+  Image src(img);
+  const int w = src.columns(), h = src.rows();
+  vector<char> data((size_t)w * h * 4);
+  src.write(0, 0, w, h, "RGBA", CharPixel, data.data());
+
+  // Write under a temporary name so concurrent servers never read a partial file
+  mkdir(mazecache_dir, 0755);
+  const string tmppath = path + "." + to_string(getpid()) + ".tmp";
+  ofstream file(tmppath, ios::binary);
+  file << "MAZEBG " << w << " " << h << "\n";
+  file.write(data.data(), data.size());
+  file.close();
+  if (file.good())
+    rename(tmppath.c_str(), path.c_str());
+  else
+    remove(tmppath.c_str());
+}
+
+void Game::renderMaze(Image &target, double zoom)
 {
+  const string cachepath = mazeCachePath(zoom);
+  if (backgroundhash != mazehash)
+  {
+    backgrounds.clear();
+    backgroundhash = mazehash;
+  }
+  if (backgrounds.count(cachepath))
+  {
+    // Magick++ images share pixels until written to
+    target = backgrounds[cachepath];
+    return;
+  }
+  if (readMazeCache(target, cachepath))
+  {
+    if (verbose)
+      cout << "Maze background loaded from " << cachepath << endl;
+    backgrounds[cachepath] = target;
+    return;
+  }
+
   // Drawing lots of small lines is apparently quite slow, so we
   // parallelize this and then cache the mazeimage to reuse at every frame
+  target = Image(Geometry(lround(renderW * zoom), lround(renderH * zoom)), Color("white"));
   promise<Image *> resp[3];
   thread *threads[3];
-  threads[0] = new thread(renderMazeRow, 0, ref(resp[0]), this);
-  threads[1] = new thread(renderMazeRow, 1, ref(resp[1]), this);
-  threads[2] = new thread(renderMazeRow, 2, ref(resp[2]), this);
+  threads[0] = new thread(renderMazeRow, 0, zoom, ref(resp[0]), this);
+  threads[1] = new thread(renderMazeRow, 1, zoom, ref(resp[1]), this);
+  threads[2] = new thread(renderMazeRow, 2, zoom, ref(resp[2]), this);
   for (int t = 0; t < 3; ++t)
   {
     threads[t]->join();
     Image *img = resp[t].get_future().get();
-    mazeimage.composite(*img, 0, 0, OverCompositeOp);
+    target.composite(*img, 0, 0, OverCompositeOp);
     delete threads[t];
     delete img;
   }
+  writeMazeCache(target, cachepath);
+  backgrounds[cachepath] = target;
 }
 
-void Game::loadMaze(string mazepath)
+void Game::setupRender()
 {
-  // Assumes game is empty:
-  ifstream mapfile(mazepath);
-  string token;
-  while (mapfile.good())
-  {
-    mapfile >> token;
-    myassert(mapfile.good(), "Error reading wall.");
-    if (token == "wall")
-    {
-      mapfile >> token;
-      myassert(mapfile.good(), "Error reading wall.");
-      int x0 = stoi(token);
-      mapfile >> token;
-      myassert(mapfile.good(), "Error reading wall.");
-      int y0 = stoi(token);
-      mapfile >> token;
-      myassert(mapfile.good(), "Error reading wall.");
-      int x1 = stoi(token);
-      mapfile >> token;
-      int y1 = stoi(token);
-
-      Line *ln = new Line(x0, y0, x1, y1);
-      // Push onto appropriate tile
-      Walls(x0, y0).push_back(ln);
-    }
-    else
-      myerror("Error reading maze: " + mazepath);
+  bgimage = Image(Geometry(ui(1920), ui(1080)), Color("#e5e5e5")); // bgimage("img/bgtexture.png"),
+  if (tier.direct)
+  {
+    renderMaze(mainmaze, mainZoom());
+    renderMaze(focusmaze, focusZoom());
+    return;
   }
-
-  // Add default walls
-  for (int i = 0; i < tileW; ++i)
+  renderMaze(mazeimage, 1.0);
+  lastframe = mazeimage;
+  if (native_render)
   {
-    Walls(i, 0).push_back(new Line(i, 0, i + 1, 0));
-    Walls(i, tileH).push_back(new Line(i, tileH, i + 1, tileH));
+    mazeraster = Raster(mazeimage);
+    bgraster = Raster(ui(1920), ui(1080), Raster::parseColor("#e5e5e5"));
+    lastraster.reset(new Raster(mazeraster));
   }
-  for (int i = 0; i < tileH; ++i)
+}
+
+vector<int> CpuBudget::sim;
+vector<int> CpuBudget::render;
+vector<int> CpuBudget::agents;
+int CpuBudget::magickthreads = 0;
+
+bool CpuBudget::parseList(const string &spec, vector<int> &cpus)
+{
+  cpus.clear();
+  stringstream in(spec);
+  string part;
+  while (getline(in, part, ','))
   {
-    Walls(0, i).push_back(new Line(0, i, 0, i + 1));
-    Walls(tileW, i).push_back(new Line(tileW, i, tileW, i + 1));
+    int first, last, used = 0;
+    if (sscanf(part.c_str(), "%d-%d%n", &first, &last, &used) != 2 || used != (int)part.size())
+    {
+      used = 0;
+      if (sscanf(part.c_str(), "%d%n", &first, &used) != 1 || used != (int)part.size())
+        return false;
+      last = first;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE)
+      return false;
+    for (int c = first; c <= last; ++c)
+      cpus.push_back(c);
   }
+  return !cpus.empty();
 }
 
-void Game::renderFrame(set<IElem *> &visible)
+void CpuBudget::toMask(const vector<int> &cpus, cpu_set_t &mask)
 {
-  // Start current frame with cached maze background
-  Image *gameimage = new Image(mazeimage);
-  gameimage->strokeWidth(11);
-  gameimage->strokeColor(Color("#000000"));
-  gameimage->strokeLineCap(RoundCap);
+  CPU_ZERO(&mask);
+  for (int c : cpus)
+    CPU_SET(c, &mask);
+}
 
-  // Render all visible elements
-  for (IElem *el : visible)
-    el->drawTo(*gameimage);
+bool CpuBudget::configure(const string &spec, int players, string &error)
+{
+  if (spec == "auto")
+  {
+    cpu_set_t mask;
+    vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+      for (int c = 0; c < CPU_SETSIZE; ++c)
+        if (CPU_ISSET(c, &mask))
+          cpus.push_back(c);
+    if (cpus.size() < players + 2)
+    {
+      cout << "Only " << cpus.size() << " CPUs available, running without pinning" << endl;
+      return true;
+    }
+    // Players are sensed in parallel on the simulation CPUs, so it gets up to
+    // one per player, taking at most half of what the agents leave over
+    const int spare = cpus.size() - players - 1;
+    const int simcpus = 1 + min(players - 1, spare / 2);
+    sim.assign(cpus.begin(), cpus.begin() + simcpus);
+    agents.assign(cpus.begin() + simcpus, cpus.begin() + simcpus + players);
+    render.assign(cpus.begin() + simcpus + players, cpus.end());
+  }
+  else
+  {
+    const size_t a = spec.find('/');
+    const size_t b = a == string::npos ? a : spec.find('/', a + 1);
+    if (b == string::npos || !parseList(spec.substr(0, a), sim) ||
+        !parseList(spec.substr(a + 1, b - a - 1), render) || !parseList(spec.substr(b + 1), agents))
+    {
+      error = "Expected --cpus SIM/RENDER/AGENTS CPU lists such as 0/1-3/4-7, or auto, got: " + spec;
+      return false;
+    }
+  }
+  // GraphicsMagick gets no more threads than the renderers have CPUs
+  if (magickthreads == 0)
+    magickthreads = render.size();
+  if (verbose)
+    cout << "Pinned to " << sim.size() << " simulation, " << render.size() << " render and "
+         << agents.size() << " agent CPUs" << endl;
+  return true;
+}
+
+void CpuBudget::limitMagick()
+{
+  if (magickthreads <= 0)
+    return;
+  // Also sets GraphicsMagick's OpenMP thread count
+  MagickLib::SetMagickResourceLimit(MagickLib::ThreadsResource, magickthreads);
+}
+
+void CpuBudget::pinThread(const vector<int> &cpus)
+{
+  if (cpus.empty())
+    return;
+  cpu_set_t mask;
+  toMask(cpus, mask);
+  const int err = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+  if (err != 0)
+    cout << "Could not pin thread to CPUs: " << strerror(err) << endl;
+}
+
+CpuBudget::Pin::Pin(const vector<int> &cpus)
+    : pinned(!cpus.empty() && pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved) == 0)
+{
+  if (pinned)
+    pinThread(cpus);
+}
+
+CpuBudget::Pin::~Pin()
+{
+  if (pinned)
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+}
+
+void CpuBudget::pinAgent(int pid, int p, int players)
+{
+  if (agents.empty())
+    return;
+  // An even share of the agent CPUs, or one of them if there are too few to share
+  vector<int> share;
+  if (agents.size() >= players)
+  {
+    const int per = agents.size() / players;
+    share.assign(agents.begin() + p * per, agents.begin() + (p + 1) * per);
+  }
+  else
+    share.push_back(agents[p % agents.size()]);
+  cpu_set_t mask;
+  toMask(share, mask);
+  // Threads the agent has already started keep their CPUs; later ones inherit these
+  if (sched_setaffinity(pid, sizeof(mask), &mask) != 0)
+    cout << "Could not pin agent " << pid << " to CPUs: " << strerror(errno) << endl;
+}
+
+int Spectators::listenfd = -1;
+boost::lockfree::spsc_queue<string> *Spectators::states = nullptr;
+atomic<bool> Spectators::stopping(false);
+thread *Spectators::broadcaster = nullptr;
+vector<Spectators::Viewer> Spectators::viewers;
+string Spectators::maze = "";
+string Spectators::path = "";
+
+bool Spectators::enabled() { return states != nullptr; }
+
+bool Spectators::start(string &error)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+  {
+    error = "Spectator socket path too long: " + path;
+    return false;
+  }
+  strcpy(addr.sun_path, path.c_str());
+  unlink(path.c_str());
+  listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (listenfd < 0 || bind(listenfd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenfd, 16) != 0)
+  {
+    error = "Could not listen on " + path + ": " + strerror(errno);
+    if (listenfd >= 0)
+      ::close(listenfd);
+    listenfd = -1;
+    return false;
+  }
+  states = new boost::lockfree::spsc_queue<string>(1024);
+  broadcaster = new thread(broadcastloop);
+  if (verbose)
+    cout << "Spectators can connect to " << path << endl;
+  return true;
+}
+
+void Spectators::publish(const string &line)
+{
+  if (states)
+    states->push(line);
+}
+
+bool Spectators::flush(Viewer &viewer)
+{
+  while (!viewer.out.empty())
+  {
+    const ssize_t n = send(viewer.fd, viewer.out.data(), viewer.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    viewer.out.erase(0, n);
+  }
+  return true;
+}
+
+void Spectators::broadcastloop()
+{
+  Trace::nameThread("spectators");
+  while (!stopping)
+  {
+    bool any = false;
+    int fd;
+    while ((fd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK)) >= 0)
+    {
+      viewers.push_back(Viewer{fd, maze});
+      any = true;
+    }
+    string line;
+    while (states->pop(line))
+    {
+      any = true;
+      line += "\n";
+      const bool ismaze = line.compare(0, 5, "maze ") == 0;
+      if (ismaze)
+        maze = line;
+      for (Viewer &viewer : viewers)
+        if (viewer.out.empty() || ismaze)
+          viewer.out += line;
+    }
+    for (size_t v = 0; v < viewers.size();)
+      if (flush(viewers[v]))
+        ++v;
+      else
+      {
+        ::close(viewers[v].fd);
+        viewers.erase(viewers.begin() + v);
+      }
+    if (!any)
+      this_thread::sleep_for(chrono::milliseconds(1));
+  }
+}
+
+void Spectators::stop()
+{
+  if (!states)
+    return;
+  stopping = true;
+  broadcaster->join();
+  delete broadcaster;
+  broadcaster = nullptr;
+  // Last lines go out if they can without blocking
+  for (Viewer &viewer : viewers)
+  {
+    flush(viewer);
+    ::close(viewer.fd);
+  }
+  viewers.clear();
+  ::close(listenfd);
+  listenfd = -1;
+  unlink(path.c_str());
+  delete states;
+  states = nullptr;
+}
+
+atomic<Trace::Buffer *> Trace::buffers(nullptr);
+atomic<int> Trace::nexttid(1);
+thread_local Trace::Buffer *Trace::local = nullptr;
+string Trace::path = "";
+
+Trace::Buffer *Trace::buffer()
+{
+  if (!local)
+  {
+    local = new Buffer();
+    local->tid = nexttid++;
+    local->thread = "thread " + to_string(local->tid);
+    local->events.reserve(4096);
+    local->next = buffers.load();
+    while (!buffers.compare_exchange_weak(local->next, local))
+      ;
+  }
+  return local;
+}
+
+void Trace::nameThread(const string &name)
+{
+  if (enabled())
+    buffer()->thread = name;
+}
+
+void Trace::record(const char *name, unsigned long long ts, unsigned long long dur, long arg)
+{
+  Buffer *b = buffer();
+  if (b->events.size() < trace_max_events)
+    b->events.push_back(Event{name, ts, dur, arg});
+}
+
+void Trace::write()
+{
+  if (!enabled())
+    return;
+  ofstream out(path);
+  out << "{\"traceEvents\": [" << endl;
+  bool first = true;
+  for (Buffer *b = buffers.load(); b; b = b->next)
+  {
+    out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << b->tid
+        << ", \"args\": {\"name\": \"" << b->thread << "\"}}";
+    first = false;
+    for (const Event &e : b->events)
+    {
+      out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << b->tid
+          << ", \"ts\": " << e.ts << ", \"dur\": " << e.dur;
+      if (e.arg >= 0)
+        out << ", \"args\": {\"n\": " << e.arg << "}";
+      out << "}";
+    }
+  }
+  out << "\n]}" << endl;
+  if (verbose)
+    cout << "Trace written to " << path << endl;
+}
+
+TraceSpan::TraceSpan(const char *_name, long _arg)
+    : name(_name), arg(_arg), t0(Trace::enabled() ? mytime_us() : 0)
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+  if (Trace::enabled())
+    Trace::record(name, t0, mytime_us() - t0, arg);
+}
+
+Histogram::Histogram()
+    : n(0), sum(0), maxv(0)
+{
+  for (int b = 0; b < buckets; ++b)
+    counts[b] = 0;
+}
+
+void Histogram::record(unsigned long long v)
+{
+  int b = 0;
+  while (b < buckets - 1 && (v >> b) != 0)
+    ++b;
+  // Only this thread writes, so relaxed read-modify-writes are enough
+  counts[b].fetch_add(1, memory_order_relaxed);
+  n.fetch_add(1, memory_order_relaxed);
+  sum.fetch_add(v, memory_order_relaxed);
+  if (v > maxv.load(memory_order_relaxed))
+    maxv.store(v, memory_order_relaxed);
+}
+
+void Histogram::clear()
+{
+  for (int b = 0; b < buckets; ++b)
+    counts[b] = 0;
+  n = 0;
+  sum = 0;
+  maxv = 0;
+}
+
+unsigned long long Histogram::count() const
+{
+  return n.load(memory_order_relaxed);
+}
+
+double Histogram::mean() const
+{
+  const unsigned long long c = count();
+  return c ? sum.load(memory_order_relaxed) / (double)c : 0.0;
+}
+
+unsigned long long Histogram::max() const
+{
+  return maxv.load(memory_order_relaxed);
+}
+
+unsigned long long Histogram::quantile(double q) const
+{
+  const unsigned long long c = count();
+  unsigned long long seen = 0;
+  for (int b = 0; b < buckets; ++b)
+  {
+    seen += counts[b].load(memory_order_relaxed);
+    if (seen > 0 && seen >= q * c)
+      return b == 0 ? 0 : min((1ULL << b) - 1, max());
+  }
+  return max();
+}
+
+Metrics::Metrics() {}
+
+Metrics::~Metrics() {}
+
+void Metrics::add(const string &name, const string &unit, const Histogram *hist)
+{
+  entries.push_back(Entry{name, unit, hist});
+}
+
+string Metrics::toJSON() const
+{
+  stringstream out;
+  out << "{";
+  for (int i = 0; i < entries.size(); ++i)
+  {
+    const Histogram &h = *entries[i].hist;
+    out << (i ? ", " : "") << "\"" << entries[i].name << "\": {"
+        << "\"unit\": \"" << entries[i].unit << "\", "
+        << "\"count\": " << h.count() << ", "
+        << "\"mean\": " << h.mean() << ", "
+        << "\"p50\": " << h.quantile(0.5) << ", "
+        << "\"p90\": " << h.quantile(0.9) << ", "
+        << "\"p99\": " << h.quantile(0.99) << ", "
+        << "\"max\": " << h.max() << "}";
+  }
+  out << "}";
+  return out.str();
+}
+
+string Metrics::toCSV() const
+{
+  stringstream out;
+  out << "name,unit,count,mean,p50,p90,p99,max\n";
+  for (const Entry &e : entries)
+    out << e.name << "," << e.unit << "," << e.hist->count() << "," << e.hist->mean() << ","
+        << e.hist->quantile(0.5) << "," << e.hist->quantile(0.9) << ","
+        << e.hist->quantile(0.99) << "," << e.hist->max() << "\n";
+  return out.str();
+}
+
+void Metrics::write(const string &prefix) const
+{
+  ofstream json(prefix + ".json");
+  json << toJSON() << endl;
+  ofstream csv(prefix + ".csv");
+  csv << toCSV();
+  if (verbose)
+    cout << "Metrics written to " << prefix << ".json and " << prefix << ".csv" << endl;
+}
+
+TickClock::TickClock(int period_ms)
+    : periodns(period_ms * 1000000LL), deadline(now() + period_ms * 1000000LL), overruns()
+{
+}
+
+long long TickClock::now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+unsigned long long TickClock::wait(int frame, unsigned long long stepus, unsigned long long composeus)
+{
+  const long long t = now();
+  unsigned long long lateus = 0;
+  if (t > deadline)
+  {
+    lateus = (t - deadline) / 1000;
+    overruns.push_back(Overrun{frame, lateus, stepus, composeus});
+    if (verbose)
+      cout << "Frame " << frame << " overran by " << lateus / 1000.0 << " ms ("
+           << (stepus >= composeus ? "simulation step " : "frame compose ")
+           << max(stepus, composeus) / 1000.0 << " ms)" << endl;
+    // More than a whole tick behind: start over from now rather than
+    // rushing through several short ticks to catch up
+    if (t - deadline >= periodns)
+      deadline = t;
+  }
+  else
+  {
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+      ;
+  }
+  deadline += periodns;
+  return lateus;
+}
+
+const vector<TickClock::Overrun> &TickClock::getOverruns() const
+{
+  return overruns;
+}
+
+void TickClock::writeOverruns(const string &path) const
+{
+  ofstream out(path);
+  out << "frame,late_us,step_us,compose_us\n";
+  for (const Overrun &o : overruns)
+    out << o.frame << "," << o.lateus << "," << o.stepus << "," << o.composeus << "\n";
+}
+
+MappedFile::MappedFile(const string &path)
+    : fd(::open(path.c_str(), O_RDONLY)), addr(nullptr), len(0)
+{
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0)
+    return;
+  len = st.st_size;
+  // mmap refuses empty files; they are simply empty
+  if (len > 0)
+  {
+    addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+    {
+      addr = nullptr;
+      len = 0;
+    }
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if (addr)
+    munmap(addr, len);
+  if (fd >= 0)
+    ::close(fd);
+}
+
+bool MappedFile::isOpen() const
+{
+  return fd >= 0 && (addr || len == 0);
+}
+
+const char *MappedFile::data() const
+{
+  return (const char *)addr;
+}
+
+size_t MappedFile::size() const
+{
+  return len;
+}
+
+MazeData::MazeData()
+    : w(11), h(11), hash(0)
+{
+}
+
+string MazeData::checkWall(const array<int, 4> &wall, set<array<int, 4>> &seen) const
+{
+  const int x0 = wall[0], y0 = wall[1], x1 = wall[2], y1 = wall[3];
+  if (min(x0, x1) < 0 || max(x0, x1) > w || min(y0, y1) < 0 || max(y0, y1) > h)
+    return "wall outside the " + to_string(w) + "x" + to_string(h) + " maze";
+  if (x0 == x1 && y0 == y1)
+    return "wall has zero length";
+  // The same wall may be written from either end
+  const array<int, 4> key = make_pair(x0, y0) < make_pair(x1, y1) ? wall : array<int, 4>{x1, y1, x0, y0};
+  if (!seen.insert(key).second)
+    return "duplicate wall";
+  return "";
+}
+
+bool MazeData::parse(const char *data, size_t len, string &error)
+{
+  w = h = 11;
+  walls.clear();
+  hash = hashBytes(data, len);
+  if (len >= 4 && memcmp(data, "MAZB", 4) == 0)
+    return parseBinary(data, len, error);
+  return parseText(data, len, error);
+}
+
+bool MazeData::parseText(const char *data, size_t len, string &error)
+{
+  const char *p = data, *end = data + len;
+  int line = 1;
+  set<array<int, 4>> seen;
+
+  auto fail = [&error, &line](const string &msg)
+  {
+    error = "line " + to_string(line) + ": " + msg;
+    return false;
+  };
+  auto skipSpace = [&p, end]()
+  {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+      ++p;
+  };
+  auto word = [&p, end]()
+  {
+    const char *start = p;
+    while (p < end && !isspace((unsigned char)*p))
+      ++p;
+    return string(start, p);
+  };
+  auto number = [&p, end, &skipSpace](int &out)
+  {
+    skipSpace();
+    bool neg = p < end && *p == '-';
+    if (neg)
+      ++p;
+    if (p == end || !isdigit((unsigned char)*p))
+      return false;
+    long v = 0;
+    while (p < end && isdigit((unsigned char)*p) && v <= 1000000)
+      v = v * 10 + (*p++ - '0');
+    if (v > 1000000 || (p < end && !isspace((unsigned char)*p)))
+      return false;
+    out = (int)(neg ? -v : v);
+    return true;
+  };
+
+  while (p < end)
+  {
+    skipSpace();
+    if (p < end && *p == '\n')
+    {
+      ++p;
+      ++line;
+      continue;
+    }
+    if (p == end)
+      break;
+
+    const string token = word();
+    if (token == "size")
+    {
+      // Optional header giving the maze size in tiles
+      if (!walls.empty())
+        return fail("maze size must come before any walls");
+      if (!number(w) || !number(h))
+        return fail("expected size W H");
+      if (w <= 0 || h <= 0 || w > 4096 || h > 4096)
+        return fail("maze size must be between 1 and 4096");
+    }
+    else if (token == "wall")
+    {
+      array<int, 4> wall;
+      for (int &v : wall)
+        if (!number(v))
+          return fail("expected wall x0 y0 x1 y1");
+      const string bad = checkWall(wall, seen);
+      if (bad != "")
+        return fail(bad);
+      walls.push_back(wall);
+    }
+    else
+      return fail("unknown entry '" + token + "'");
+
+    skipSpace();
+    if (p < end && *p != '\n')
+      return fail("unexpected text after " + token);
+  }
+  return true;
+}
+
+bool MazeData::parseBinary(const char *data, size_t len, string &error)
+{
+  size_t off = 4;
+  set<array<int, 4>> seen;
+
+  auto u16 = [data, len, &off](int &out)
+  {
+    if (off + 2 > len)
+      return false;
+    out = (unsigned char)data[off] | ((unsigned char)data[off + 1] << 8);
+    off += 2;
+    return true;
+  };
+  auto fail = [&error, &off](const string &msg)
+  {
+    error = "offset " + to_string(off) + ": " + msg;
+    return false;
+  };
+
+  int version = 0, lo = 0, hi = 0;
+  if (!u16(version) || !u16(w) || !u16(h) || !u16(lo) || !u16(hi))
+    return fail("truncated header");
+  if (version != 1)
+    return fail("unsupported binary maze version " + to_string(version));
+  if (w <= 0 || h <= 0 || w > 4096 || h > 4096)
+    return fail("maze size must be between 1 and 4096");
+  const size_t count = (size_t)lo | ((size_t)hi << 16);
+  if (count > (len - off) / 8)
+    return fail("truncated walls");
+  walls.reserve(count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    array<int, 4> wall;
+    for (int &v : wall)
+      u16(v);
+    const string bad = checkWall(wall, seen);
+    if (bad != "")
+      return fail(bad);
+    walls.push_back(wall);
+  }
+  if (off != len)
+    return fail("trailing bytes");
+  return true;
+}
+
+bool MazeData::load(const string &path, string &error)
+{
+  MappedFile file(path);
+  if (!file.isOpen())
+  {
+    error = path + ": could not open maze";
+    return false;
+  }
+  if (!parse(file.data(), file.size(), error))
+  {
+    error = path + ": " + error;
+    return false;
+  }
+  return true;
+}
+
+string MazeData::toBinary() const
+{
+  string out = "MAZB";
+  auto u16 = [&out](int v)
+  {
+    out += (char)(v & 0xff);
+    out += (char)((v >> 8) & 0xff);
+  };
+  u16(1);
+  u16(w);
+  u16(h);
+  u16(walls.size() & 0xffff);
+  u16(walls.size() >> 16);
+  for (const array<int, 4> &wall : walls)
+    for (int v : wall)
+      u16(v);
+  return out;
+}
+
+MazeGen::MazeGen(const string &algo, unsigned seed, int _w, int _h)
+    : w(_w), h(_h), rng(seed), east(_w * _h, true), south(_w * _h, true)
+{
+  myassert(w > 0 && h > 0, "Maze size must be positive.");
+  if (algo == "backtracker")
+    backtracker();
+  else if (algo == "kruskal")
+    kruskal();
+  else if (algo == "braid")
+  {
+    backtracker();
+    braid(0.5);
+  }
+  else
+    myerror("Unknown maze algorithm: " + algo + " (use backtracker, kruskal or braid)");
+}
+
+int MazeGen::pick(int n)
+{
+  return (int)(rng() % (unsigned)n);
+}
+
+void MazeGen::carve(int a, int b)
+{
+  if (a > b)
+    swap(a, b);
+  if (b == a + 1)
+    east[a] = false;
+  else
+    south[a] = false;
+}
+
+int MazeGen::wallCount(int cell) const
+{
+  const int x = cell % w, y = cell / w;
+  return (x == 0 || east[cell - 1]) + (x == w - 1 || east[cell]) + (y == 0 || south[cell - w]) + (y == h - 1 || south[cell]);
+}
+
+void MazeGen::backtracker()
+{
+  vector<bool> seen(w * h, false);
+  vector<int> stack;
+  stack.push_back(pick(w * h));
+  seen[stack.back()] = true;
+  while (!stack.empty())
+  {
+    const int cell = stack.back();
+    const int x = cell % w, y = cell / w;
+    int next[4];
+    int n = 0;
+    if (x > 0 && !seen[cell - 1])
+      next[n++] = cell - 1;
+    if (x < w - 1 && !seen[cell + 1])
+      next[n++] = cell + 1;
+    if (y > 0 && !seen[cell - w])
+      next[n++] = cell - w;
+    if (y < h - 1 && !seen[cell + w])
+      next[n++] = cell + w;
+    if (n == 0)
+    {
+      stack.pop_back();
+      continue;
+    }
+    const int to = next[pick(n)];
+    carve(cell, to);
+    seen[to] = true;
+    stack.push_back(to);
+  }
+}
+
+void MazeGen::kruskal()
+{
+  // Every interior wall as (cell, 0 = east | 1 = south), in a seeded order
+  vector<pair<int, int>> edges;
+  for (int cell = 0; cell < w * h; ++cell)
+  {
+    if (cell % w < w - 1)
+      edges.push_back(make_pair(cell, 0));
+    if (cell / w < h - 1)
+      edges.push_back(make_pair(cell, 1));
+  }
+  for (int i = (int)edges.size() - 1; i > 0; --i)
+    swap(edges[i], edges[pick(i + 1)]);
+
+  vector<int> parent(w * h);
+  for (int i = 0; i < w * h; ++i)
+    parent[i] = i;
+  auto find = [&parent](int c)
+  {
+    while (parent[c] != c)
+      c = parent[c] = parent[parent[c]];
+    return c;
+  };
+  for (const pair<int, int> &e : edges)
+  {
+    const int a = e.first, b = e.first + (e.second ? w : 1);
+    const int ra = find(a), rb = find(b);
+    if (ra != rb)
+    {
+      parent[ra] = rb;
+      carve(a, b);
+    }
+  }
+}
+
+void MazeGen::braid(double loops)
+{
+  for (int cell = 0; cell < w * h; ++cell)
+  {
+    if (wallCount(cell) < 3 || (rng() % 1000) >= loops * 1000)
+      continue;
+    // Prefer opening into another dead end, removing two at once
+    const int x = cell % w, y = cell / w;
+    int next[4];
+    int n = 0, dead = 0;
+    auto consider = [&](bool open, int to)
+    {
+      if (!open)
+        return;
+      if (wallCount(to) >= 3)
+      {
+        // Dead ends go first
+        next[n++] = next[dead];
+        next[dead++] = to;
+      }
+      else
+        next[n++] = to;
+    };
+    consider(x > 0 && east[cell - 1], cell - 1);
+    consider(x < w - 1 && east[cell], cell + 1);
+    consider(y > 0 && south[cell - w], cell - w);
+    consider(y < h - 1 && south[cell], cell + w);
+    if (n > 0)
+      carve(cell, next[dead > 0 ? pick(dead) : pick(n)]);
+  }
+}
+
+string MazeGen::toString() const
+{
+  stringstream out;
+  out << "size " << w << " " << h;
+  for (int y = 0; y < h; ++y)
+    for (int x = 0; x < w; ++x)
+    {
+      if (x < w - 1 && east[y * w + x])
+        out << "\nwall " << x + 1 << " " << y << " " << x + 1 << " " << y + 1;
+      if (y < h - 1 && south[y * w + x])
+        out << "\nwall " << x << " " << y + 1 << " " << x + 1 << " " << y + 1;
+    }
+  // Like the files in mazepool/, no trailing newline
+  return out.str();
+}
+
+void MazeGen::writeTo(const string &path) const
+{
+  ofstream file(path, ios::binary);
+  const string text = toString();
+  if (path.size() > 6 && path.compare(path.size() - 6, 6, ".mazeb") == 0)
+  {
+    MazeData maze;
+    string error;
+    myassert(maze.parse(text.data(), text.size(), error), "Generated an invalid maze: " + error);
+    file << maze.toBinary();
+  }
+  else
+    file << text;
+  myassert(file.good(), "Could not write maze: " + path);
+}
+
+bool MazeGen::isSpec(const string &mazepath)
+{
+  return mazepath.compare(0, 4, "gen:") == 0;
+}
+
+MazeGen MazeGen::fromSpec(const string &spec)
+{
+  // gen:algo:seed:WxH
+  stringstream in(spec.substr(4));
+  string algo;
+  unsigned seed = 0;
+  int w = 0, h = 0;
+  char sep = 0, x = 0;
+  getline(in, algo, ':');
+  in >> seed >> sep >> w >> x >> h;
+  myassert(!in.fail() && sep == ':' && (x == 'x' || x == 'X'), "Maze spec must look like gen:algo:seed:WxH, got " + spec);
+  return MazeGen(algo, seed, w, h);
+}
+
+bool Game::preloadMaze(const string &mazepath, string &error)
+{
+  if (mazes.count(mazepath))
+    return true;
+  MazeData maze;
+  if (MazeGen::isSpec(mazepath))
+  {
+    const string text = MazeGen::fromSpec(mazepath).toString();
+    if (!maze.parse(text.data(), text.size(), error))
+    {
+      error = mazepath + ": " + error;
+      return false;
+    }
+  }
+  else if (!maze.load(mazepath, error))
+    return false;
+  mazes[mazepath] = maze;
+  return true;
+}
+
+void Game::loadMaze(string mazepath)
+{
+  string error;
+  myassert(preloadMaze(mazepath, error), "Error reading maze: " + error);
+  const MazeData &maze = mazes[mazepath];
+  mazehash = maze.hash;
+
+  // Assumes game is empty:
+  tileW = maze.w;
+  tileH = maze.h;
+  // Only one game is drawn at a time; headless ones may be of any size
+  if (!headless)
+  {
+    ::tileW = tileW;
+    ::tileH = tileH;
+  }
+  walls.resize((tileW + 1) * (tileH + 1));
+  for (const array<int, 4> &wall : maze.walls)
+  {
+    Line *ln = new Line(wall[0], wall[1], wall[2], wall[3]);
+    // Push onto appropriate tile
+    Walls(wall[0], wall[1]).push_back(ln);
+  }
+
+  // Add default walls
+  for (int i = 0; i < tileW; ++i)
+  {
+    Walls(i, 0).push_back(new Line(i, 0, i + 1, 0));
+    Walls(i, tileH).push_back(new Line(i, tileH, i + 1, tileH));
+  }
+  for (int i = 0; i < tileH; ++i)
+  {
+    Walls(0, i).push_back(new Line(0, i, 0, i + 1));
+    Walls(tileW, i).push_back(new Line(tileW, i, tileW, i + 1));
+  }
+  indexEdges();
+}
+
+void Game::indexEdges()
+{
+  edges.assign((tileW + 1) * (tileH + 1) * 2, nullptr);
+  for (const vector<Line *> &tile : walls)
+    for (Line *w : tile)
+    {
+      // Diagonal walls are left out
+      const int x0 = min(w->getX0(), w->getX1()), x1 = max(w->getX0(), w->getX1());
+      const int y0 = min(w->getY0(), w->getY1()), y1 = max(w->getY0(), w->getY1());
+      if (x0 == x1)
+        for (int y = y0; y < y1; ++y)
+          Edge(x0, y, true) = w;
+      else if (y0 == y1)
+        for (int x = x0; x < x1; ++x)
+          Edge(x, y0, false) = w;
+    }
+}
+
+void Game::findDirtyRects(set<IElem *> &visible, set<Line *> &wallsnow,
+                          vector<IElem *> &sprites, vector<array<int, 4>> &dirty)
+{
+  for (IElem *el : visible)
+  {
+    Line *ln = dynamic_cast<Line *>(el);
+    if (ln && !dynamic_cast<TWall *>(ln))
+      wallsnow.insert(ln);
+    else
+      sprites.push_back(el);
+  }
+
+  vector<array<int, 4>> rects;
+  for (IElem *el : sprites)
+  {
+    array<int, 4> r;
+    el->drawBounds(r[0], r[1], r[2], r[3]);
+    rects.push_back(r);
+  }
+  dirty = lastrects;
+  dirty.insert(dirty.end(), rects.begin(), rects.end());
+  for (Line *ln : lastwalls)
+    if (wallsnow.find(ln) == wallsnow.end())
+    {
+      array<int, 4> r;
+      ln->drawBounds(r[0], r[1], r[2], r[3]);
+      dirty.push_back(r);
+    }
+  for (Line *ln : wallsnow)
+    if (lastwalls.find(ln) == lastwalls.end())
+    {
+      array<int, 4> r;
+      ln->drawBounds(r[0], r[1], r[2], r[3]);
+      dirty.push_back(r);
+    }
+
+  // Clip to the game image
+  for (array<int, 4> &r : dirty)
+  {
+    r[0] = max(r[0], 0);
+    r[1] = max(r[1], 0);
+    r[2] = min(r[2], renderW);
+    r[3] = min(r[3], renderH);
+  }
+
+  lastrects = rects;
+  lastwalls = wallsnow;
+}
+
+Image *Game::composeImage(set<Line *> &wallsnow, vector<IElem *> &sprites,
+                          vector<array<int, 4>> &dirty)
+{
+  Image *gameimage = new Image(lastframe);
+  gameimage->strokeWidth(strokePx(11));
+  gameimage->strokeColor(Color("#000000"));
+  gameimage->strokeLineCap(RoundCap);
+
+  // Restore each dirty rect from the maze and redraw the visible walls
+  // crossing it, clipped to the rect
+  for (array<int, 4> &r : dirty)
+  {
+    const int x0 = r[0], y0 = r[1], x1 = r[2], y1 = r[3];
+    if (x1 <= x0 || y1 <= y0)
+      continue;
+    Image patch(Geometry(x1 - x0, y1 - y0), Color("white"));
+    patch.composite(mazeimage, -x0, -y0, CopyCompositeOp);
+    patch.strokeWidth(strokePx(11));
+    patch.strokeColor(Color("#000000"));
+    patch.strokeLineCap(RoundCap);
+    for (Line *ln : wallsnow)
+    {
+      int lx0, ly0, lx1, ly1;
+      ln->drawBounds(lx0, ly0, lx1, ly1);
+      if (lx0 < x1 && x0 < lx1 && ly0 < y1 && y0 < ly1)
+        ln->drawTo(patch, 1.0, x0, y0);
+    }
+    gameimage->composite(patch, x0, y0, CopyCompositeOp);
+  }
+
+  // Sprites animate every frame, so each is drawn exactly once on top
+  for (IElem *el : sprites)
+    el->drawTo(*gameimage);
+
+  lastframe = *gameimage;
+  return gameimage;
+}
+
+shared_ptr<Raster> Game::composeRaster(set<Line *> &wallsnow, vector<IElem *> &sprites,
+                                       vector<array<int, 4>> &dirty)
+{
+  // Frames are read-only once sent down the pipeline, so the last one is
+  // shared with the render threads rather than copied twice
+  shared_ptr<Raster> gameraster(new Raster(*lastraster));
+  gameraster->strokeWidth(strokePx(11));
+  gameraster->strokeColor("#000000");
+
+  for (array<int, 4> &r : dirty)
+  {
+    const int x0 = r[0], y0 = r[1], x1 = r[2], y1 = r[3];
+    if (x1 <= x0 || y1 <= y0)
+      continue;
+    gameraster->copyFrom(mazeraster, x0, y0, x1 - x0, y1 - y0);
+    gameraster->clip(x0, y0, x1, y1);
+    for (Line *ln : wallsnow)
+    {
+      int lx0, ly0, lx1, ly1;
+      ln->drawBounds(lx0, ly0, lx1, ly1);
+      if (lx0 < x1 && x0 < lx1 && ly0 < y1 && y0 < ly1)
+        ln->drawTo(*gameraster);
+    }
+    gameraster->unclip();
+  }
+
+  for (IElem *el : sprites)
+    el->drawTo(*gameraster);
+
+  lastraster = gameraster;
+  return gameraster;
+}
+
+void Game::animate(set<IElem *> &visible)
+{
+  Scene skipped;
+  for (IElem *el : visible)
+    el->addTo(skipped);
+}
+
+void Game::renderFrame(set<IElem *> &visible)
+{
+  // Animations (and coin respawn / TWall timers) step every simulated frame,
+  // even those the tier does not render
+  if (framecount % tier.framestep != 0 || !rendering)
+  {
+    animate(visible);
+    return;
+  }
+
+  Image *gameimage = 0;
+  shared_ptr<Raster> gameraster;
+  Scene *scene = 0;
+  if (tier.direct)
+  {
+    // Each view is drawn at its output size by the render threads
+    scene = new Scene();
+    for (IElem *el : visible)
+      el->addTo(*scene);
+  }
+  else
+  {
+    // Start current frame from the previous one; the static maze is already
+    // baked in, so only regions where sprites were or are now, and walls that
+    // became visible or hidden, are restored from the maze and redrawn
+    set<Line *> wallsnow;
+    vector<IElem *> sprites;
+    vector<array<int, 4>> dirty;
+    findDirtyRects(visible, wallsnow, sprites, dirty);
+    if (native_render)
+      gameraster = composeRaster(wallsnow, sprites, dirty);
+    else
+      gameimage = composeImage(wallsnow, sprites, dirty);
+  }
 
   // Push out to the renderer thread
   RenderMessage *rm;
   if (players.size() == 1)
-    rm = new RenderMessage(gameimage,
+    rm = new RenderMessage(gameimage, gameraster, scene,
                            gameX(players[0]->getX()),
                            gameY(players[0]->getY()),
-                           gameX(11),
-                           gameY(11),
-                           players[0]->getName() + " " + std::to_string(players[0]->getflagCount()) + " Flags",
-                           "Capture Collect 1-player",
+                           gameX(tileW),
+                           gameY(tileH),
+                           players[0]->getName(), players[0]->getflagCount(), players[0]->getcoinCount(),
+                           "Capture Collect 1-player", -1, -1,
                            players[0]->getLog(),
                            vector<string>());
   else
-    rm = new RenderMessage(gameimage,
-                           gameX(players[0]->getX()),
-                           gameY(players[0]->getY()),
-                           gameX(players[1]->getX()),
-                           gameY(players[1]->getY()),
-                           players[0]->getName() + " " + std::to_string(players[0]->getflagCount()) + " " + std::to_string(players[0]->getcoinCount()),
-                           players[1]->getName() + " " + std::to_string(players[1]->getflagCount()) + " " + std::to_string(players[1]->getcoinCount()),
-                           players[0]->getLog(),
-                           players[1]->getLog());
+  {
+    int a, b;
+    featured(a, b);
+    rm = new RenderMessage(gameimage, gameraster, scene,
+                           gameX(players[a]->getX()),
+                           gameY(players[a]->getY()),
+                           gameX(players[b]->getX()),
+                           gameY(players[b]->getY()),
+                           players[a]->getName(), players[a]->getflagCount(), players[a]->getcoinCount(),
+                           players[b]->getName(), players[b]->getflagCount(), players[b]->getcoinCount(),
+                           players[a]->getLog(),
+                           players[b]->getLog());
+  }
   while (!to_renderer[0]->push(rm))
     ;
 }
@@ -968,18 +3196,19 @@ void Game::addCoins(vector<IElem *> &objects)
 {
   for (int i = 0; i < 20; i++)
   {
-    double x = randomPos();
-    double y = randomPos();
+    double x = randomPos(tileW, rng);
+    double y = randomPos(tileH, rng);
     objects.push_back(new Coin(x, y));
   }
 }
 
 void Game::addTWall(double x0, double y0, double x1, double y1)
 {
-  Line *twall = new TWall(x0, y0, x1, y1);
+  Line *twall = new TWall(x0, y0, x1, y1, this);
   // Line *ln = new Line(x0, y0, x1, y1);
   // Push onto appropriate tile
   Walls(x0, y0).push_back(twall);
+  indexEdges();
 }
 
 void Game::removeTWall(TWall *twall)
@@ -993,23 +3222,40 @@ void Game::removeTWall(TWall *twall)
     wall_vec.erase(it);
   }
   delete twall;
+  indexEdges();
+}
+
+vector<int> Game::ranking()
+{
+  vector<int> order(players.size());
+  for (int p = 0; p < order.size(); ++p)
+    order[p] = p;
+  stable_sort(order.begin(), order.end(), [this](int p, int q)
+              { return make_pair(players[p]->getflagCount(), players[p]->total_coin_collected) >
+                       make_pair(players[q]->getflagCount(), players[q]->total_coin_collected); });
+  return order;
 }
 
 int Game::getWinner()
 {
-  Robot* player1 = players.at(0);
-  Robot* player2 = players.at(1);
-  if(player1->getflagCount()==player2->getflagCount())
+  const vector<int> order = ranking();
+  Robot *first = players.at(order.at(0));
+  Robot *second = players.at(order.at(1));
+  if (first->getflagCount() == second->getflagCount() && first->total_coin_collected == second->total_coin_collected)
+    return -1;
+  return order[0];
+}
+
+void Game::featured(int &a, int &b)
+{
+  a = 0;
+  b = 1;
+  if (players.size() > 2)
   {
-    if(player1->total_coin_collected == player2->total_coin_collected)
-    {
-      return -1;
-    }
-    else
-      return player1->total_coin_collected > player2->total_coin_collected ? 0 : 1;
+    const vector<int> order = ranking();
+    a = order[0];
+    b = order[1];
   }
-  else
-    return player1->getflagCount() > player2->getflagCount() ? 0 : 1;
 }
 
 // adds 1 sec of worth of frames to the renderring
@@ -1021,6 +3267,8 @@ void Game::winningScreen()
   final_img.fillColor(Color("black"));
   final_img.fontPointsize(100);
   int winner = getWinner();
+  int a, b;
+  featured(a, b);
   // winner = 0;
   std::string winner_str = winner == -1 ? "==" : "Winner";
   // std::string winner_str = "Winner";
@@ -1039,22 +3287,24 @@ void Game::winningScreen()
                         WestGravity);
 
   final_img.fontPointsize(40);
-  final_img.annotate(players[0]->getName()+" captured " + to_string(players[0]->getflagCount())+" Flags & "+ to_string(players[0]->total_coin_collected) + " Coins",
+  final_img.annotate(players[a]->getName()+" captured " + to_string(players[a]->getflagCount())+" Flags & "+ to_string(players[a]->total_coin_collected) + " Coins",
                       Geometry(350, 50, hoz-70, 590),
                       WestGravity);  
 
-  final_img.annotate(players[1]->getName()+" captured " + to_string(players[1]->getflagCount())+" Flags & "+ to_string(players[1]->total_coin_collected) + " Coins",
+  final_img.annotate(players[b]->getName()+" captured " + to_string(players[b]->getflagCount())+" Flags & "+ to_string(players[b]->total_coin_collected) + " Coins",
                       Geometry(350, 50, hoz-70, 640),
                       WestGravity);
-    for(int i=0;i<16;i++)
+    for(int i=0;i<16;i+=tier.framestep)
     {
       Image temp_img = final_img; 
       if(!Tie)                     
         temp_img.composite(players.at(winner)->greenbot[i], 850, 350, OverCompositeOp);
       else{
-        temp_img.composite(players.at(0)->greenbot[i], hoz + 50, 350, OverCompositeOp);
-        temp_img.composite(players.at(1)->greenbot[i], hoz + 225, 350, OverCompositeOp);
+        temp_img.composite(players.at(a)->greenbot[i], hoz + 50, 350, OverCompositeOp);
+        temp_img.composite(players.at(b)->greenbot[i], hoz + 225, 350, OverCompositeOp);
       }
+      if (tier.scale != 1.0)
+        temp_img.zoom(Geometry(ui(1920), ui(1080)));
       string countstr = to_string(framecount);
       framecount++;
       while (countstr.size() < 7)
@@ -1063,22 +3313,21 @@ void Game::winningScreen()
     }
 }
 
-Game::Game(string mazepath, string agentcmd)
-    : mazeimage(Geometry(renderW, renderH), Color("white")),
-      bgimage(Geometry(1920, 1080), Color("#e5e5e5")), // bgimage("img/bgtexture.png"),
-      walls{}, players(), objects(),
-      framecount(0), starttime(mytime()),
+Game::Game(string mazepath, string agentcmd, const RenderTier &_tier)
+    : mazeimage(), bgimage(),
+      mazeraster(), bgraster(),
+      tier(_tier), renderlimit((framelimit + _tier.framestep - 1) / _tier.framestep),
+      mainmaze(), focusmaze(),
+      lastframe(), lastraster(), lastrects(), lastwalls(),
+      tileW(11), tileH(11), walls(), edges(), players(), objects(),
+      framecount(0), starttime(mytime()), mazehash(0),
+      rng(_mt()), headless(false), startframe(0), sensors(nullptr),
       to_renderer(),
       renderers()
 {
   game_singleton = this;
   for (int i = 0; i < 5; ++i)
     to_renderer.push_back(new boost::lockfree::spsc_queue<RenderMessage *>(32 * 1024));
-  renderers.push_back(new thread(renderloop0, this));
-  renderers.push_back(new thread(renderloop1, this));
-  renderers.push_back(new thread(renderloop2, this));
-  renderers.push_back(new thread(renderloop3, this));
-  renderers.push_back(new thread(renderloop4, this));
 
   if (verbose)
     cout << "Game Initialization" << endl;
@@ -1086,61 +3335,235 @@ Game::Game(string mazepath, string agentcmd)
   loadMaze(mazepath);
   if (verbose)
     cout << "Maze Loaded" << endl;
-  // Pre-render maze walls
-  renderMaze();
-  if (verbose)
-    cout << "Maze Rendered" << endl;
 
-  addCoins(objects);
+  // Launch the agent first, so it boots while everything else loads
   Robot *bot = new Robot(agentcmd, 0.5, 0.5, this, false);
   players.push_back(bot);
+  placeObjects();
+  setup();
   if (verbose)
     cout << "Player Initialized" << endl;
-  objects.push_back(new Home(0.5, 0.5));
-  objects.push_back(new Flag(true, 10.5, 10.5));
 }
 
-Game::Game(string mazepath, string agent1cmd, string agent2cmd)
-    : mazeimage(Geometry(renderW, renderH), Color("white")),
-      bgimage(Geometry(1920, 1080), Color("#e5e5e5")), // bgimage("img/bgtexture.png"),
-      walls{}, players(), objects(),
-      framecount(0), starttime(mytime()),
+Game::Game(string mazepath, string agent1cmd, string agent2cmd, const RenderTier &_tier)
+    : Game(mazepath, vector<string>{agent1cmd, agent2cmd}, _tier)
+{
+}
+
+Game::Game(string mazepath, const vector<string> &agentcmds, const RenderTier &_tier)
+    : mazeimage(), bgimage(),
+      mazeraster(), bgraster(),
+      tier(_tier), renderlimit((framelimit + _tier.framestep - 1) / _tier.framestep),
+      mainmaze(), focusmaze(),
+      lastframe(), lastraster(), lastrects(), lastwalls(),
+      tileW(11), tileH(11), walls(), edges(), players(), objects(),
+      framecount(0), starttime(mytime()), mazehash(0),
+      rng(_mt()), headless(false), startframe(0), sensors(nullptr),
       to_renderer(),
       renderers()
 {
   game_singleton = this;
   for (int i = 0; i < 5; ++i)
     to_renderer.push_back(new boost::lockfree::spsc_queue<RenderMessage *>(32 * 1024));
-  renderers.push_back(new thread(renderloop0, this));
-  renderers.push_back(new thread(renderloop1, this));
-  renderers.push_back(new thread(renderloop2, this));
-  renderers.push_back(new thread(renderloop3, this));
-  renderers.push_back(new thread(renderloop4, this));
 
-  if (verbose)
-    cout << "Game Initialization" << endl;
-  // Load maze data
-  loadMaze(mazepath);
-  if (verbose)
-    cout << "Maze Loaded" << endl;
-  // Pre-render maze walls
-  renderMaze();
-  if (verbose)
-    cout << "Maze Rendered" << endl;
+  if (verbose)
+    cout << "Game Initialization" << endl;
+  // Load maze data
+  loadMaze(mazepath);
+  if (verbose)
+    cout << "Maze Loaded" << endl;
+
+  // Launch every agent first, so they boot together while everything else loads
+  const int n = agentcmds.size();
+  myassert(n >= 2 && n <= 2 * (tileW + tileH) - 4, "Too many players for a " + to_string(tileW) + "x" + to_string(tileH) + " maze");
+  for (int p = 0; p < n; ++p)
+  {
+    double x, y;
+    startOf(p, n, x, y);
+    players.push_back(new Robot(agentcmds[p], x, y, this, p % 2 == 0));
+  }
+  placeObjects();
+  setup();
+  if (verbose)
+    cout << "Players Initialized" << endl;
+}
+
+Game::Game(const string &mazepath, int players)
+    : mazeimage(), bgimage(),
+      mazeraster(), bgraster(),
+      tier(), renderlimit(0),
+      mainmaze(), focusmaze(),
+      lastframe(), lastraster(), lastrects(), lastwalls(),
+      tileW(11), tileH(11), walls(), edges(), players(), objects(),
+      framecount(0), starttime(mytime()), mazehash(0),
+      rng(_mt()), headless(true), startframe(0), sensors(nullptr),
+      to_renderer(),
+      renderers()
+{
+  loadMaze(mazepath);
+  myassert(players >= 1 && players <= 2 * (tileW + tileH) - 4, "Too many players for a " + to_string(tileW) + "x" + to_string(tileH) + " maze");
+  if (players == 1)
+    this->players.push_back(new Robot("", 0.5, 0.5, this, false));
+  else
+    for (int p = 0; p < players; ++p)
+    {
+      double x, y;
+      startOf(p, players, x, y);
+      this->players.push_back(new Robot("", x, y, this, p % 2 == 0));
+    }
+  placeObjects();
+}
+
+Game *Game::simulation(const string &mazepath, int players)
+{
+  return new Game(mazepath, players);
+}
+
+void Game::placeObjects()
+{
+  addCoins(objects);
+  if (players.size() == 1)
+  {
+    objects.push_back(new Home(0.5, 0.5));
+    objects.push_back(new Flag(true, tileW - 0.5, tileH - 0.5));
+    return;
+  }
+  for (int p = 0; p < players.size(); ++p)
+    objects.push_back(new Flag(p % 2 == 0, players[p]->getHomeX(), players[p]->getHomeY()));
+  for (Robot *bot : players)
+    objects.push_back(new Home(bot->getHomeX(), bot->getHomeY()));
+}
+
+void Game::startOf(int p, int n, double &x, double &y) const
+{
+  // Clockwise from the top left: top row, right column, bottom row, left column
+  const int ring = 2 * (tileW + tileH) - 4;
+  int i = (int)((long)p * ring / n);
+  int tx, ty;
+  if (i < tileW)
+    tx = i, ty = 0;
+  else if ((i -= tileW - 1) < tileH)
+    tx = tileW - 1, ty = i;
+  else if ((i -= tileH - 1) < tileW)
+    tx = tileW - 1 - i, ty = tileH - 1;
+  else
+    i -= tileW - 1, tx = 0, ty = tileH - 1 - i;
+  x = tx + 0.5;
+  y = ty + 0.5;
+}
+
+void Game::reseed(unsigned seed)
+{
+  rng.seed(seed);
+  for (IElem *obj : objects)
+    if (Coin *coin = dynamic_cast<Coin *>(obj))
+    {
+      coin->setX(randomPos(tileW, rng));
+      coin->setY(randomPos(tileH, rng));
+    }
+}
+
+void Game::setup()
+{
+  // Robot sprites load on their own threads while this one renders the maze
+  vector<future<void>> sprites;
+  if (rendering)
+    for (Robot *bot : players)
+      sprites.push_back(async(launch::async, [bot]()
+                              {
+                                CpuBudget::pinThread(CpuBudget::render);
+                                bot->loadSprites(); }));
+  // Warm agents are pinned again, as they may have played another side
+  for (int p = 0; p < players.size(); ++p)
+    CpuBudget::pinAgent(players[p]->getAgentPid(), p, players.size());
+  // Pre-render maze walls
+  if (rendering)
+  {
+    setupRender();
+    if (verbose)
+      cout << "Maze Rendered" << endl;
+  }
+  for (future<void> &done : sprites)
+    done.get();
+
+  waitForAgents();
+
+  // Resume a checkpointed match; the renderers only expect the frames left
+  if (restorepath != "")
+  {
+    ifstream in(restorepath);
+    myassert(in.good(), "Could not read game state " + restorepath);
+    stringstream state;
+    state << in.rdbuf();
+    restoreState(state.str());
+    startframe = framecount;
+    renderlimit = (framelimit + tier.framestep - 1) / tier.framestep - (startframe + tier.framestep - 1) / tier.framestep;
+    if (verbose)
+      cout << "Resuming from frame " << startframe << " of " << restorepath << endl;
+  }
+  registerMetrics();
+  if (Spectators::enabled())
+    Spectators::publish(writeMazeState());
+  const int sensecpus = CpuBudget::sim.empty() ? thread::hardware_concurrency() : CpuBudget::sim.size();
+  sensors = new WorkerPool(min<int>(players.size(), sensecpus), "sense ", CpuBudget::sim);
+
+  if (renderthreads && rendering)
+  {
+    renderers.push_back(new thread(renderloop0, this));
+    renderers.push_back(new thread(renderloop1, this));
+    renderers.push_back(new thread(renderloop2, this));
+    renderers.push_back(new thread(renderloop3, this));
+    renderers.push_back(new thread(renderloop4, this));
+  }
+}
+
+void Game::waitForAgents()
+{
+  const unsigned long long t0 = mytime();
+  for (Robot *bot : players)
+    while (!bot->isReady() && mytime() - t0 < agenttimeout)
+      this_thread::sleep_for(chrono::milliseconds(2));
+  for (int p = 0; p < players.size(); ++p)
+    if (!players[p]->isReady() && agenttimeout > 0)
+      cout << "Player " << p + 1 << " did not say himynameis within " << agenttimeout << " ms, starting anyway" << endl;
+  if (verbose)
+    cout << "Agents ready after " << mytime() - t0 << " ms" << endl;
+}
+
+void Game::registerMetrics()
+{
+  metrics.add("step", "us", &stepus);
+  metrics.add("compose", "us", &composeus);
+  metrics.add("late", "us", &lateus);
+  for (int p = 0; p < players.size(); ++p)
+  {
+    senseus.emplace_back();
+    metrics.add("sense.p" + to_string(p), "us", &senseus[p]);
+    metrics.add("agent.p" + to_string(p), "us", &players[p]->getCmdLatency());
+  }
+  for (int i = 0; i < 5; ++i)
+  {
+    metrics.add("stage" + to_string(i), "us", &stageus[i]);
+    metrics.add("queue" + to_string(i), "frames", &queuedepth[i]);
+  }
+}
+
+void Game::streamMetrics()
+{
+  ofstream out(metricspath + ".stream.jsonl", ios::app);
+  out << "{\"frame\": " << framecount << ", \"metrics\": " << metrics.toJSON() << "}" << endl;
+}
 
-  addCoins(objects);
-  objects.push_back(new Flag(true, 0.5, 0.5));
-  objects.push_back(new Flag(false, 10.5, 10.5));
-  Robot *bot1 = new Robot(agent1cmd, 0.5, 0.5, this, true);
-  players.push_back(bot1);
-  objects.push_back(new Home(0.5, 0.5));
-  if (verbose)
-    cout << "Player 1 Initialized" << endl;
-  Robot *bot2 = new Robot(agent2cmd, 10.5, 10.5, this, false);
-  players.push_back(bot2);
-  objects.push_back(new Home(10.5, 10.5));
-  if (verbose)
-    cout << "Player 2 Initialized" << endl;
+void Game::writeCheckpoint()
+{
+  // Renamed into place, so a crash never leaves half a checkpoint
+  const string tmp = checkpointpath + ".tmp";
+  {
+    ofstream out(tmp);
+    out << saveState();
+    myassert(out.good(), "Could not write " + tmp);
+  }
+  myassert(rename(tmp.c_str(), checkpointpath.c_str()) == 0, "Could not write " + checkpointpath);
 }
 
 Game *Game::getGame()
@@ -1157,14 +3580,18 @@ Game::~Game()
   for (int i = 0; i < renderers.size(); ++i)
     renderers[i]->join();
 
+  // Every stage has finished with the match by now
+  if (metricspath != "" && !headless)
+    metrics.write(metricspath);
+
   for (int i = 0; i < renderers.size(); ++i)
-  {
-    delete to_renderer[i];
     delete renderers[i];
-  }
+  for (int i = 0; i < to_renderer.size(); ++i)
+    delete to_renderer[i];
+  delete sensors;
 
-  for (int i = 0; i < (tileW + 1) * (tileH + 1); ++i)
-    for (IElem *el : walls[i])
+  for (vector<Line *> &tile : walls)
+    for (IElem *el : tile)
       delete el;
 
   for (IElem *elem : objects)
@@ -1173,9 +3600,177 @@ Game::~Game()
   for (Robot *player : players)
     delete player;
 
-  cout << "reached end of ~Game" << endl;
+  if (game_singleton == this)
+    game_singleton = nullptr;
+  if (!headless)
+    cout << "reached end of ~Game" << endl;
+}
+
+Game::Game(const Game &other)
+    : mazeimage(), bgimage(),
+      mazeraster(), bgraster(),
+      tier(other.tier), renderlimit(0),
+      mainmaze(), focusmaze(),
+      lastframe(), lastraster(), lastrects(), lastwalls(),
+      tileW(other.tileW), tileH(other.tileH), walls(other.walls.size()), edges(), players(), objects(),
+      framecount(other.framecount), starttime(other.starttime), mazehash(other.mazehash),
+      rng(other.rng), headless(true), startframe(other.startframe), sensors(nullptr),
+      to_renderer(),
+      renderers()
+{
+  for (size_t t = 0; t < walls.size(); ++t)
+    for (Line *w : other.walls[t])
+    {
+      TWall *twall = dynamic_cast<TWall *>(w);
+      walls[t].push_back(twall ? new TWall(*twall, this) : new Line(*w));
+    }
+  indexEdges();
+  // Objects keep their order, so a carried flag is found by its index
+  for (IElem *obj : other.objects)
+  {
+    Coin *coin = dynamic_cast<Coin *>(obj);
+    Flag *flag = dynamic_cast<Flag *>(obj);
+    Home *home = dynamic_cast<Home *>(obj);
+    myassert(coin || flag || home, "Cannot clone an unknown game object");
+    if (coin)
+      objects.push_back(new Coin(*coin));
+    else if (flag)
+      objects.push_back(new Flag(*flag));
+    else
+      objects.push_back(new Home(*home));
+  }
+  for (Robot *bot : other.players)
+  {
+    Flag *carried = bot->getCarriedFlag();
+    if (carried)
+      carried = (Flag *)objects[find(other.objects.begin(), other.objects.end(), carried) - other.objects.begin()];
+    players.push_back(new Robot(*bot, this, carried));
+  }
+}
+
+Game *Game::clone() const
+{
+  return new Game(*this);
+}
+
+string Game::saveState() const
+{
+  ostringstream out;
+  out << "state 1 " << tileW << " " << tileH << " " << players.size() << " " << objects.size() << "\n"
+      << "frame " << framecount << "\n"
+      << "rng " << rng << "\n";
+  for (Robot *bot : players)
+    out << bot->writeState(objects) << "\n";
+  // A line per object, homes included, so indices line up on restore
+  for (IElem *obj : objects)
+  {
+    Coin *coin = dynamic_cast<Coin *>(obj);
+    Flag *flag = dynamic_cast<Flag *>(obj);
+    out << (coin ? coin->writeState() : flag ? flag->writeState() : "home") << "\n";
+  }
+  for (const vector<Line *> &tile : walls)
+    for (Line *w : tile)
+      if (TWall *twall = dynamic_cast<TWall *>(w))
+        out << twall->writeState() << "\n";
+  return out.str();
+}
+
+void Game::restoreState(const string &state)
+{
+  // TWalls are replaced by those in the state
+  for (vector<Line *> &tile : walls)
+    for (size_t i = 0; i < tile.size();)
+      if (dynamic_cast<TWall *>(tile[i]))
+      {
+        delete tile[i];
+        tile.erase(tile.begin() + i);
+      }
+      else
+        ++i;
+
+  istringstream lines(state);
+  string line;
+  int robot = 0, object = 0;
+  while (getline(lines, line))
+  {
+    istringstream in(line);
+    string kind;
+    in >> kind;
+    if (kind == "state")
+    {
+      int version, w, h, np, no;
+      in >> version >> w >> h >> np >> no;
+      myassert(version == 1, "Unknown game state version");
+      myassert(w == tileW && h == tileH && np == players.size() && no == objects.size(),
+               "Game state is for another maze or number of players");
+    }
+    else if (kind == "frame")
+      in >> framecount;
+    else if (kind == "rng")
+      in >> rng;
+    else if (kind == "robot")
+    {
+      myassert(robot < players.size(), "Too many robots in game state");
+      players[robot++]->readState(in, objects);
+    }
+    else if (kind == "coin" || kind == "flag" || kind == "home")
+    {
+      myassert(object < objects.size(), "Too many objects in game state");
+      IElem *obj = objects[object++];
+      Coin *coin = dynamic_cast<Coin *>(obj);
+      Flag *flag = dynamic_cast<Flag *>(obj);
+      myassert(kind == "coin" ? coin != nullptr : kind == "flag" ? flag != nullptr : dynamic_cast<Home *>(obj) != nullptr,
+               "Game state object " + to_string(object - 1) + " should be a " + kind);
+      if (coin)
+        coin->readState(in);
+      else if (flag)
+        flag->readState(in);
+    }
+    else if (kind == "twall")
+    {
+      double x0, y0, x1, y1;
+      int frames;
+      in >> x0 >> y0 >> x1 >> y1 >> frames;
+      Walls(x0, y0).push_back(new TWall(x0, y0, x1, y1, this, frames));
+    }
+    else if (kind != "")
+      myerror("Unknown game state line: " + line);
+    myassert(!in.fail(), "Bad game state line: " + line);
+  }
+  myassert(robot == players.size() && object == objects.size(), "Incomplete game state");
+  indexEdges();
+}
+
+bool Game::command(int p, const string &cmd)
+{
+  return players.at(p)->runCommand(cmd);
+}
+
+void Game::advance()
+{
+  // Seen as the tick began, like the views SimStep senses
+  set<IElem *> visible;
+  for (Robot *bot : players)
+  {
+    set<IElem *> nearby;
+    vector<Line *> seen;
+    lookFrom<0, 0>(bot, visible, nearby, seen);
+  }
+  for (Robot *bot : players)
+  {
+    bot->move();
+    SimStep<0, 0, 0>::collide(*this, bot);
+  }
+  animate(visible);
+  ++framecount;
 }
 
+int Game::getFrame() const { return framecount; }
+int Game::getTileW() const { return tileW; }
+int Game::getTileH() const { return tileH; }
+const vector<Robot *> &Game::getPlayers() const { return players; }
+mt19937 &Game::getRng() { return rng; }
+
 double Game::elem_dist(double x, double y, Line *el)
 {
   double cx, cy;
@@ -1213,157 +3808,507 @@ void Game::createLineAngle(double x, double y, Line *line, set<const LineAngle *
   return;
 }
 
-void Game::splitLineAngle(const LineAngle *la0, const LineAngle *la1, set<const LineAngle *> &addSet, set<const LineAngle *> &removeSet)
+void Game::splitLineAngle(const LineAngle *la0, const LineAngle *la1, set<const LineAngle *> &addSet, set<const LineAngle *> &removeSet)
+{
+  double a = la0->minAngle, b = la0->maxAngle, c = la1->minAngle, d = la1->maxAngle;
+  if (b - c > 0 && d - a > 0) // means there is overlap, and it is not a point
+  {
+    double oa_min = max(a, c);
+    double oa_max = min(b, d);
+    if (c < oa_min)
+      addSet.insert(new LineAngle(la1->line, c, oa_min));
+    if (d > oa_max)
+      addSet.insert(new LineAngle(la1->line, oa_max, d));
+    removeSet.insert(la1);
+  }
+  return;
+}
+
+bool Game::isBlocked(double x, double y, double x1, double y1, set<const LineAngle *> &lineAngles)
+{
+  double angle = atan2(y - y1, x1 - x);
+  for (const LineAngle *la : lineAngles)
+  {
+    if (la->minAngle <= angle && angle <= la->maxAngle)
+      return true;
+  }
+  return false;
+}
+
+bool Game::isWall(double x0, double y0, double x1, double y1)
+{ 
+  std::cout << "x0 : " << x0 << "y0 : " << y0 << std::endl;
+  for (Line* l : Walls(x0,y0))
+  {
+    std::cout << l->writeStatus() << std::endl;
+    if (l->getX0() == x0 && l->getY0() == y0 && l->getX1() == x1 && l->getY1() == y1)
+      return true;
+  }
+  return false;
+}
+
+
+template <int W, int H>
+void Game::lookFrom(Robot *bot, set<IElem *> &visible, set<IElem *> &nearby, vector<Line *> &seen)
+{
+  typedef BoardDims<W, H> Dims;
+
+  double x = bot->getX();
+  double y = bot->getY();
+
+  auto line_angle_dist = [x, y, this](const LineAngle *la0, const LineAngle *la1)
+  {
+    return elem_rad_dist(x, y, la0, la1);
+  };
+
+  // Each wall is stored on exactly one tile, so no de-duplication is needed
+  vector<Line *> nearby_walls;
+  nearby_walls.reserve(64);
+  set<const LineAngle *, function<bool(const LineAngle *fst, const LineAngle *snd)>> lineAngles(line_angle_dist);
+
+  int w_range = 5;
+  const int i1 = min((int)x + w_range, Dims::w(tileW)), j1 = min((int)y + w_range, Dims::h(tileH));
+  for (int j = max((int)y - w_range, 0); j <= j1; ++j)
+    for (int i = max((int)x - w_range, 0); i <= i1; ++i)
+    {
+      const vector<Line *> &tile = walls[Dims::cell(i, j, tileW)];
+      nearby_walls.insert(nearby_walls.end(), tile.begin(), tile.end());
+    }
+  set<const LineAngle *> removeSet;
+  set<const LineAngle *> addSet;
+  set<const LineAngle *> finalSet;
+  // Every LineAngle made below, freed on return
+  vector<unique_ptr<const LineAngle>> owned;
+  // converting all the lines to lineangle objects, splitting the required ones.
+  for (Line *w : nearby_walls)
+    createLineAngle(x, y, w, addSet, removeSet);
+
+  for (const LineAngle *la : addSet)
+  {
+    owned.emplace_back(la);
+    lineAngles.insert(la);
+  }
+  while (lineAngles.size() > 0)
+  {
+    addSet.clear();
+    removeSet.clear();
+    const LineAngle *cur_la = *lineAngles.begin(); // get the first element
+    finalSet.insert(cur_la);                       // adding current element to finalSet
+    lineAngles.erase(cur_la);                      // delete the first element
+
+    for (const LineAngle *la : lineAngles)
+      splitLineAngle(cur_la, la, addSet, removeSet);
+    for (const LineAngle *la : removeSet)
+      lineAngles.erase(la);
+    for (const LineAngle *la : addSet)
+    {
+      owned.emplace_back(la);
+      lineAngles.insert(la);
+    }
+  }
+  for (Robot *pl : players)
+  {
+    if (pl != bot && pl->withinRange(x, y, 5) && !isBlocked(x, y, pl->getX(), pl->getY(), finalSet))
+      nearby.insert(pl);
+    visible.insert(pl);
+  }
+
+  for (IElem *obj : objects)
+  {
+    if (obj->withinRange(x, y, 5) && !isBlocked(x, y, obj->getX(), obj->getY(), finalSet))
+      nearby.insert(obj);
+    visible.insert(obj);
+  }
+  for (const LineAngle *la : finalSet)
+  {
+    seen.push_back(la->line);
+    visible.insert(la->line);
+  }
+}
+
+template <int W, int H>
+string Game::senseFrom(Robot *bot, set<IElem *> &visible)
+{
+  typedef BoardDims<W, H> Dims;
+
+  if (rays > 0)
+    return senseRaysFrom(bot, visible);
+
+  set<IElem *> nearby;
+  vector<Line *> seen;
+  lookFrom<W, H>(bot, visible, nearby, seen);
+
+  string out = "";
+  double x = bot->getX();
+  double y = bot->getY();
+  if (framecount == startframe)
+    out += "maze " + to_string(Dims::w(tileW)) + " " + to_string(Dims::h(tileH)) + "\n";
+  out += "bot " + to_string(x) + " " + to_string(y) + " " + to_string(bot->getcoinCount()) + "\n";
+  for (IElem *el : nearby)
+  {
+    out += el->writeStatus() + "\n";
+  }
+  for (Line *w : seen)
+    out += w->writeStatus() + "\n";
+  return out;
+}
+
+double Game::castRay(double x, double y, double a, double range, Line *&hit)
+{
+  // Walk the tiles the ray passes through (Amanatides & Woo), checking only
+  // the edge crossed into each one
+  const double dx = cos(a), dy = sin(a);
+  int i = (int)x, j = (int)y;
+  const int si = dx > 0 ? 1 : -1, sj = dy > 0 ? 1 : -1;
+  const double ddx = dx != 0 ? 1 / abs(dx) : INFINITY, ddy = dy != 0 ? 1 / abs(dy) : INFINITY;
+  double tx = dx > 0 ? (i + 1 - x) * ddx : dx < 0 ? (x - i) * ddx : INFINITY;
+  double ty = dy > 0 ? (j + 1 - y) * ddy : dy < 0 ? (y - j) * ddy : INFINITY;
+  hit = nullptr;
+  while (min(tx, ty) <= range)
+  {
+    if (tx < ty)
+    {
+      const int ex = dx > 0 ? i + 1 : i;
+      if (ex < 0 || ex > tileW || j < 0 || j >= tileH)
+        break;
+      if ((hit = Edge(ex, j, true)))
+        return tx;
+      i += si;
+      tx += ddx;
+    }
+    else
+    {
+      const int ey = dy > 0 ? j + 1 : j;
+      if (ey < 0 || ey > tileH || i < 0 || i >= tileW)
+        break;
+      if ((hit = Edge(i, ey, false)))
+        return ty;
+      j += sj;
+      ty += ddy;
+    }
+  }
+  return range;
+}
+
+void Game::castRays(Robot *bot, int k, double range, double *dist, Line **hit)
+{
+  for (int r = 0; r < k; ++r)
+    dist[r] = castRay(bot->getX(), bot->getY(), bot->getA() + 2 * M_PI * r / k, range, hit[r]);
+}
+
+string Game::senseRaysFrom(Robot *bot, set<IElem *> &visible)
+{
+  const double x = bot->getX(), y = bot->getY();
+  const double range = 5;
+  string out = "";
+  if (framecount == startframe)
+    out += "maze " + to_string(tileW) + " " + to_string(tileH) + "\n";
+  out += "bot " + to_string(x) + " " + to_string(y) + " " + to_string(bot->getcoinCount()) + "\n";
+
+  // Objects are seen when a ray toward them reaches them first
+  auto seen = [&](IElem *el)
+  {
+    const double d = sqrt((el->getX() - x) * (el->getX() - x) + (el->getY() - y) * (el->getY() - y));
+    Line *hit;
+    return el->withinRange(x, y, range) && castRay(x, y, atan2(el->getY() - y, el->getX() - x), d, hit) >= d;
+  };
+  for (Robot *pl : players)
+  {
+    if (pl != bot && seen(pl))
+      out += pl->writeStatus() + "\n";
+    visible.insert(pl);
+  }
+  for (IElem *obj : objects)
+  {
+    const string status = obj->writeStatus();
+    if (status != "" && seen(obj))
+      out += status + "\n";
+    visible.insert(obj);
+  }
+
+  vector<double> dist(rays);
+  vector<Line *> hit(rays);
+  castRays(bot, rays, range, dist.data(), hit.data());
+  for (int r = 0; r < rays; ++r)
+  {
+    out += "ray " + to_string(bot->getA() + 2 * M_PI * r / rays) + " " + to_string(dist[r]);
+    if (hit[r])
+    {
+      out += " " + hit[r]->writeStatus();
+      visible.insert(hit[r]);
+    }
+    out += "\n";
+  }
+  return out;
+}
+
+void Game::senseNumeric(Robot *bot, float *out, set<IElem *> &visible)
+{
+  typedef NumericView V;
+
+  set<IElem *> nearby;
+  vector<Line *> seen;
+  lookFrom<0, 0>(bot, visible, nearby, seen);
+
+  fill(out, out + V::size, 0.0f);
+  const double x = bot->getX(), y = bot->getY();
+  const int ox = (int)x - V::range, oy = (int)y - V::range;
+
+  // Each wall is a unit (or longer) axis-aligned segment; mark its ends and
+  // every half tile between them
+  for (const Line *w : seen)
+  {
+    const int x0 = (int)(2 * (w->getX0() - ox)), y0 = (int)(2 * (w->getY0() - oy));
+    const int x1 = (int)(2 * (w->getX1() - ox)), y1 = (int)(2 * (w->getY1() - oy));
+    const int steps = max(abs(x1 - x0), abs(y1 - y0));
+    for (int k = 0; k <= steps; ++k)
+    {
+      const int cx = x0 + (x1 - x0) * k / max(steps, 1), cy = y0 + (y1 - y0) * k / max(steps, 1);
+      if (cx >= 0 && cx < V::wallcells && cy >= 0 && cy < V::wallcells)
+        out[V::walls + cy * V::wallcells + cx] = 1.0f;
+    }
+  }
+
+  for (IElem *el : nearby)
+  {
+    const int cx = (int)el->getX() - ox, cy = (int)el->getY() - oy;
+    if (cx < 0 || cx >= V::tiles || cy < 0 || cy >= V::tiles)
+      continue;
+    const int cell = cy * V::tiles + cx;
+    if (dynamic_cast<Coin *>(el))
+      out[V::coins + cell] += 1.0f;
+    else if (Flag *flag = dynamic_cast<Flag *>(el))
+      out[V::flags + cell] = flag->isGreen() ? 1.0f : -1.0f;
+    else if (dynamic_cast<Robot *>(el))
+      out[V::robots + cell] += 1.0f;
+  }
+
+  float *self = out + V::self;
+  self[0] = x - (int)x;
+  self[1] = y - (int)y;
+  self[2] = bot->getV();
+  self[3] = cos(bot->getA());
+  self[4] = sin(bot->getA());
+  self[5] = bot->getcoinCount();
+  self[6] = bot->getCarriedFlag() ? 1.0f : 0.0f;
+}
+
+string Game::writeMazeState()
+{
+  string out = "maze " + to_string(tileW) + " " + to_string(tileH);
+  for (const vector<Line *> &tile : walls)
+    for (Line *w : tile)
+      if (!dynamic_cast<TWall *>(w))
+        out += ";" + w->writeStatus();
+  return out;
+}
+
+string Game::writeTickState()
+{
+  string out = "tick " + to_string(framecount);
+  for (int p = 0; p < players.size(); ++p)
+  {
+    Robot *bot = players[p];
+    out += ";player " + to_string(p) + " " + to_string(bot->getX()) + " " + to_string(bot->getY()) + " " +
+           to_string(bot->getcoinCount()) + " " + to_string(bot->getflagCount()) + " " +
+           to_string(bot->total_coin_collected);
+  }
+  for (IElem *obj : objects)
+  {
+    const string status = obj->writeStatus();
+    if (status != "")
+      out += ";" + status;
+  }
+  for (const vector<Line *> &tile : walls)
+    for (Line *w : tile)
+      if (dynamic_cast<TWall *>(w))
+        out += ";" + w->writeStatus();
+  return out;
+}
+
+string Game::writeRenderViewFrom(Robot *bot, set<IElem *> &visible)
+{
+  return senseFrom<0, 0>(bot, visible);
+}
+
+WorkerPool::WorkerPool(int threads, const string &name, const vector<int> &cpus)
+    : workers(), lock(), wake(), finished(), job(nullptr), jobsize(0), generation(0), pending(0), stopping(false)
+{
+  for (int w = 1; w < threads; ++w)
+    workers.push_back(thread(workloop, this, w, name + to_string(w), cpus));
+}
+
+WorkerPool::~WorkerPool()
 {
-  double a = la0->minAngle, b = la0->maxAngle, c = la1->minAngle, d = la1->maxAngle;
-  if (b - c > 0 && d - a > 0) // means there is overlap, and it is not a point
   {
-    double oa_min = max(a, c);
-    double oa_max = min(b, d);
-    if (c < oa_min)
-      addSet.insert(new LineAngle(la1->line, c, oa_min));
-    if (d > oa_max)
-      addSet.insert(new LineAngle(la1->line, oa_max, d));
-    removeSet.insert(la1);
+    lock_guard<mutex> guard(lock);
+    stopping = true;
   }
-  return;
+  wake.notify_all();
+  for (thread &worker : workers)
+    worker.join();
 }
 
-bool Game::isBlocked(double x, double y, double x1, double y1, set<const LineAngle *> &lineAngles)
+int WorkerPool::size() const { return workers.size() + 1; }
+
+void WorkerPool::workloop(WorkerPool *self, int w, string name, vector<int> cpus)
 {
-  double angle = atan2(y - y1, x1 - x);
-  for (const LineAngle *la : lineAngles)
+  Trace::nameThread(name);
+  CpuBudget::pinThread(cpus);
+  int seen = 0;
+  while (true)
   {
-    if (la->minAngle <= angle && angle <= la->maxAngle)
-      return true;
+    {
+      unique_lock<mutex> guard(self->lock);
+      self->wake.wait(guard, [&]()
+                      { return self->stopping || self->generation != seen; });
+      if (self->stopping)
+        return;
+      seen = self->generation;
+    }
+    self->runShare(w);
+    lock_guard<mutex> guard(self->lock);
+    if (--self->pending == 0)
+      self->finished.notify_one();
   }
-  return false;
 }
 
-bool Game::isWall(double x0, double y0, double x1, double y1)
-{ 
-  std::cout << "x0 : " << x0 << "y0 : " << y0 << std::endl;
-  for (Line* l : Walls(x0,y0))
+void WorkerPool::runShare(int w)
+{
+  const int n = jobsize, k = size();
+  for (int i = n * w / k; i < n * (w + 1) / k; ++i)
+    (*job)(i);
+}
+
+void WorkerPool::run(int n, const function<void(int)> &fn)
+{
+  if (workers.empty() || n <= 1)
   {
-    std::cout << l->writeStatus() << std::endl;
-    if (l->getX0() == x0 && l->getY0() == y0 && l->getX1() == x1 && l->getY1() == y1)
-      return true;
+    for (int i = 0; i < n; ++i)
+      fn(i);
+    return;
   }
-  return false;
+  {
+    lock_guard<mutex> guard(lock);
+    job = &fn;
+    jobsize = n;
+    pending = workers.size();
+    ++generation;
+  }
+  wake.notify_all();
+  runShare(0);
+  unique_lock<mutex> guard(lock);
+  finished.wait(guard, [this]()
+                { return pending == 0; });
 }
 
-
-string Game::writeRenderViewFrom(Robot *bot, set<IElem *> &visible)
+template <int W, int H, int P>
+void SimStep<W, H, P>::step(Game &game, set<IElem *> &visible)
 {
-  string out = "";
-  double x = bot->getX();
-  double y = bot->getY();
+  const int n = P > 0 ? P : (int)game.players.size();
 
-  auto line_angle_dist = [x, y, this](const LineAngle *la0, const LineAngle *la1)
+  // Every view is of the game as the tick began, so they are sensed at once
+  vector<string> views(n);
+  vector<set<IElem *>> seen(n);
+  const function<void(int)> sense = [&](int p)
   {
-    return elem_rad_dist(x, y, la0, la1);
+    const unsigned long long t0 = mytime_us();
+    views[p] = game.senseFrom<W, H>(game.players[p], seen[p]);
+    const unsigned long long t1 = mytime_us();
+    game.senseus[p].record(t1 - t0);
+    if (Trace::enabled())
+      Trace::record("sense", t0, t1 - t0, p);
   };
+  if (game.sensors)
+    game.sensors->run(n, sense);
+  else
+    for (int p = 0; p < n; ++p)
+      sense(p);
 
-  set<Line *> nearby_walls;
-  set<const LineAngle *, function<bool(const LineAngle *fst, const LineAngle *snd)>> lineAngles(line_angle_dist);
-  set<IElem *> nearby;
+  // order of players, meaning one player's moves will be processed before the other
+  for (int p = 0; p < n; ++p)
+  {
+    Robot *bot = game.players[p];
+    visible.insert(seen[p].begin(), seen[p].end());
 
-  int w_range = 5;
-  for (int i = max((int)x - w_range, 0); i <= min((int)x + w_range, tileW); ++i)
-    for (int j = max((int)y - w_range, 0); j <= min((int)y + w_range, tileH); ++j)
-      for (Line *w : Walls(i, j))
-        nearby_walls.insert(w);
-  set<const LineAngle *> removeSet;
-  set<const LineAngle *> addSet;
-  set<const LineAngle *> finalSet;
-  // converting all the lines to lineangle objects, splitting the required ones.
-  for (Line *w : nearby_walls)
-    createLineAngle(x, y, w, addSet, removeSet);
+    // Send bot its view and process its actions
+    bot->play(views[p]);
 
-  for (const LineAngle *la : addSet)
-  {
-    lineAngles.insert(la);
+    // Process all collisions for bot
+    collide(game, bot);
   }
-  while (lineAngles.size() > 0)
-  {
-    addSet.clear();
-    removeSet.clear();
-    const LineAngle *cur_la = *lineAngles.begin(); // get the first element
-    finalSet.insert(cur_la);                       // adding current element to finalSet
-    lineAngles.erase(cur_la);                      // delete the first element
+}
 
-    for (const LineAngle *la : lineAngles)
-      splitLineAngle(cur_la, la, addSet, removeSet);
-    for (const LineAngle *la : removeSet)
-      lineAngles.erase(la);
-    for (const LineAngle *la : addSet)
-      lineAngles.insert(la);
-  }
-  for (Robot *pl : players)
-  {
-    if (pl != bot && pl->withinRange(x, y, 5) && !isBlocked(x, y, pl->getX(), pl->getY(), finalSet))
-      nearby.insert(pl);
-    visible.insert(pl);
-  }
+template <int W, int H, int P>
+void SimStep<W, H, P>::collide(Game &game, Robot *bot)
+{
+  typedef BoardDims<W, H> Dims;
+
+  // Walls stored on its tile and on the tiles to its right and below,
+  // then all objects
+  const double px1 = bot->getX();
+  const double py1 = bot->getY();
+  const vector<Line *> &w0 = game.walls[Dims::cell((int)px1, (int)py1, game.tileW)];
+  const vector<Line *> &w1 = game.walls[Dims::cell((int)(px1 + 1), (int)py1, game.tileW)];
+  const vector<Line *> &w2 = game.walls[Dims::cell((int)px1, (int)(py1 + 1), game.tileW)];
+  for (Line *el : w0)
+    el->visit(bot);
+  for (Line *el : w1)
+    el->visit(bot);
+  for (Line *el : w2)
+    el->visit(bot);
+  for (IElem *el : game.objects)
+    el->visit(bot);
+}
 
-  for (IElem *obj : objects)
-  {
-    if (obj->withinRange(x, y, 5) && !isBlocked(x, y, obj->getX(), obj->getY(), finalSet))
-      nearby.insert(obj);
-    visible.insert(obj);
-  }
-  out += "bot " + to_string(x) + " " + to_string(y) + " " + to_string(bot->getcoinCount()) + "\n";
-  for (IElem *el : nearby)
-  {
-    out += el->writeStatus() + "\n";
-  }
-  for (const LineAngle *la : finalSet)
+ISimStep *ISimStep::create(int w, int h, int players)
+{
+  if (sim_specialize && w == 11 && h == 11)
   {
-    out += la->line->writeStatus() + "\n";
-    visible.insert(la->line);
+    if (players == 1)
+      return new SimStep<11, 11, 1>();
+    if (players == 2)
+      return new SimStep<11, 11, 2>();
   }
-  return out;
+  if (verbose)
+    cout << "Simulating a " << w << "x" << h << " maze with " << players << " players on the generic path." << endl;
+  return new SimStep<0, 0, 0>();
 }
 
 void Game::play1()
 {
   if (verbose)
     cout << "Beginning a 1-player game." << endl;
+  unique_ptr<ISimStep> simstep(ISimStep::create(tileW, tileH, players.size()));
 
+  Trace::nameThread("simulation");
+  CpuBudget::Pin pin(CpuBudget::sim);
+  TickClock ticks(frame_ms);
   while (framecount < framelimit)
   {
-    frametime = mytime();
+    TraceSpan tick("tick", framecount);
 
     set<IElem *> visible;
 
     // Simulate all players
-    for (Robot *bot : players)
-    {
-      double px = bot->getX();
-      double py = bot->getY();
-
-      // Send bot its view and process its actions
-      // bot->play(writeRenderViewFrom(px, py, visible));
-      bot->play(writeRenderViewFrom(bot, visible));
-
-      double px1 = bot->getX();
-      double py1 = bot->getY();
-
-      // Process all collisions for bot
-      vector<IElem *> pc; // possible collisions
-      pc.insert(pc.end(), Walls(px1, py1).begin(), Walls(px1, py1).end());
-      pc.insert(pc.end(), Walls(px1 + 1, py1).begin(), Walls(px1 + 1, py1).end());
-      pc.insert(pc.end(), Walls(px1, py1 + 1).begin(), Walls(px1, py1 + 1).end());
-      pc.insert(pc.end(), objects.begin(), objects.end());
-      for (IElem *el : pc)
-        el->visit(bot);
-    }
+    const unsigned long long t0 = mytime_us();
+    simstep->step(*this, visible);
+    const unsigned long long t1 = mytime_us();
+    stepus.record(t1 - t0);
 
     // Send this frame to the render pipeline
     renderFrame(visible);
+    if (Spectators::enabled())
+      Spectators::publish(writeTickState());
+    const unsigned long long t2 = mytime_us();
+    composeus.record(t2 - t1);
+    if (metricsevery > 0 && framecount % metricsevery == metricsevery - 1)
+      streamMetrics();
 
     // Increment to next frame/timestep
     framecount++;
+    if (checkpointevery > 0 && framecount % checkpointevery == 0)
+      writeCheckpoint();
     // cout << "Completed Frame " << (framecount-1) << endl;
 
     // Approximate Progress cout
@@ -1373,49 +4318,47 @@ void Game::play1()
       cout << "Simulation is now " << p1 << "% complete" << endl;
 
     // Wait for next frame
-    while (mytime() - frametime < frame_ms)
-      // If the wait is substantial, sleep for all but 75ms of it
-      if (mytime() - frametime < frame_ms - 125)
-        this_thread::sleep_for(chrono::milliseconds(frame_ms - (mytime() - frametime) - 75));
+    TraceSpan wait("wait");
+    lateus.record(ticks.wait(framecount - 1, t1 - t0, t2 - t1));
   }
+  if (metricspath != "" && !ticks.getOverruns().empty())
+    ticks.writeOverruns(metricspath + ".overruns.csv");
 }
 
 void Game::play2()
 {
   if (verbose)
-    cout << "Beginning a 2-player game." << endl;
+    cout << "Beginning a " << players.size() << "-player game." << endl;
+  unique_ptr<ISimStep> simstep(ISimStep::create(tileW, tileH, players.size()));
 
+  Trace::nameThread("simulation");
+  CpuBudget::Pin pin(CpuBudget::sim);
+  TickClock ticks(frame_ms);
   while (framecount < framelimit)
   {
-    frametime = mytime();
+    TraceSpan tick("tick", framecount);
 
     set<IElem *> visible;
 
     // Simulate all players
-    // order of players, meaning one player's moves will be processed before the other
-    for (Robot *bot : players)
-    {
-      // Send bot its view and process its actions
-      bot->play(writeRenderViewFrom(bot, visible));
-
-      double px1 = bot->getX();
-      double py1 = bot->getY();
-
-      // Process all collisions for bot
-      vector<IElem *> pc; // possible collisions
-      pc.insert(pc.end(), Walls(px1, py1).begin(), Walls(px1, py1).end());
-      pc.insert(pc.end(), Walls(px1 + 1, py1).begin(), Walls(px1 + 1, py1).end());
-      pc.insert(pc.end(), Walls(px1, py1 + 1).begin(), Walls(px1, py1 + 1).end());
-      pc.insert(pc.end(), objects.begin(), objects.end());
-      for (IElem *el : pc)
-        el->visit(bot);
-    }
+    const unsigned long long t0 = mytime_us();
+    simstep->step(*this, visible);
+    const unsigned long long t1 = mytime_us();
+    stepus.record(t1 - t0);
 
     // Send this frame to the render pipeline
     renderFrame(visible);
+    if (Spectators::enabled())
+      Spectators::publish(writeTickState());
+    const unsigned long long t2 = mytime_us();
+    composeus.record(t2 - t1);
+    if (metricsevery > 0 && framecount % metricsevery == metricsevery - 1)
+      streamMetrics();
 
     // Increment to next frame/timestep
     framecount++;
+    if (checkpointevery > 0 && framecount % checkpointevery == 0)
+      writeCheckpoint();
     // cout << "Completed Frame " << (framecount-1) << endl;
 
     // Approximate Progress cout
@@ -1425,59 +4368,481 @@ void Game::play2()
       cout << "Simulation is now " << p1 << "% complete" << endl;
 
     // Wait for next frame
-    while (mytime() - frametime < frame_ms)
-      // If the wait is substantial, sleep for all but 75ms of it
-      if (mytime() - frametime < frame_ms - 125)
-        this_thread::sleep_for(chrono::milliseconds(frame_ms - (mytime() - frametime) - 75));
+    TraceSpan wait("wait");
+    lateus.record(ticks.wait(framecount - 1, t1 - t0, t2 - t1));
+  }
+  if (metricspath != "" && !ticks.getOverruns().empty())
+    ticks.writeOverruns(metricspath + ".overruns.csv");
+  if (rendering)
+    winningScreen();
+}
+
+VecEnv::VecEnv(const string &mazepath, int n, int threads, int _episode, bool _numeric)
+    : base(Game::simulation(mazepath)), envs(n, nullptr), seeds(n, 0), episode(_episode),
+      flags(n, 0), coins(n, 0), numeric(_numeric), obs(numeric ? 0 : n), grids(numeric ? n * NumericView::size : 0),
+      rewards(n, 0), dones(n, 0),
+      pool(min(threads, n), "env worker ")
+{
+  myassert(n > 0, "VecEnv needs at least one env");
+  vector<unsigned> initial(n);
+  for (int i = 0; i < n; ++i)
+    initial[i] = i;
+  reset(initial.data());
+}
+
+VecEnv::~VecEnv()
+{
+  for (Game *env : envs)
+    delete env;
+  delete base;
+}
+
+void VecEnv::resetEnv(int i, unsigned seed)
+{
+  delete envs[i];
+  envs[i] = base->clone();
+  envs[i]->reseed(seed);
+  seeds[i] = seed;
+  flags[i] = 0;
+  coins[i] = 0;
+}
+
+void VecEnv::observe(int i)
+{
+  set<IElem *> visible;
+  if (numeric)
+    envs[i]->senseNumeric(envs[i]->getPlayers()[0], &grids[i * NumericView::size], visible);
+  else
+    obs[i] = envs[i]->writeRenderViewFrom(envs[i]->getPlayers()[0], visible);
+}
+
+void VecEnv::stepEnv(int i, int action)
+{
+  Game *env = envs[i];
+  Robot *bot = env->getPlayers()[0];
+  int tx = (int)bot->getX(), ty = (int)bot->getY();
+  if (action == up)
+    ty = max(ty - 1, 0);
+  else if (action == down)
+    ty = min(ty + 1, env->getTileH() - 1);
+  else if (action == left)
+    tx = max(tx - 1, 0);
+  else if (action == right)
+    tx = min(tx + 1, env->getTileW() - 1);
+  env->command(0, "toward " + to_string(tx + 0.5) + " " + to_string(ty + 0.5));
+  env->advance();
+
+  rewards[i] = env_coin_reward * (bot->total_coin_collected - coins[i]) + env_flag_reward * (bot->getflagCount() - flags[i]);
+  coins[i] = bot->total_coin_collected;
+  flags[i] = bot->getflagCount();
+  dones[i] = env->getFrame() >= episode;
+  if (dones[i])
+    resetEnv(i, seeds[i] + envs.size());
+  observe(i);
+}
+
+int VecEnv::size() const { return envs.size(); }
+
+void VecEnv::reset(const unsigned *seeds)
+{
+  pool.run(envs.size(), [&](int i)
+           {
+           resetEnv(i, seeds[i]);
+           rewards[i] = 0;
+           dones[i] = 0;
+           observe(i); });
+}
+
+void VecEnv::step(const int *actions)
+{
+  pool.run(envs.size(), [&](int i)
+           { stepEnv(i, actions[i]); });
+}
+
+const string *VecEnv::observations() const
+{
+  myassert(!numeric, "VecEnv: observations() on an env made for numeric observations");
+  return obs.data();
+}
+
+const float *VecEnv::numericObservations() const
+{
+  myassert(numeric, "VecEnv: numericObservations() on an env made for text observations");
+  return grids.data();
+}
+
+const float *VecEnv::getRewards() const { return rewards.data(); }
+const uint8_t *VecEnv::getDones() const { return dones.data(); }
+
+// C interface to VecEnv, e.g. for Python through ctypes
+extern "C"
+{
+  void *vecenv_new(const char *mazepath, int n, int threads)
+  {
+    return new VecEnv(mazepath, n, threads);
+  }
+
+  // Observations as floats, see NumericView and vecenv_numeric
+  void *vecenv_new_numeric(const char *mazepath, int n, int threads)
+  {
+    return new VecEnv(mazepath, n, threads, framelimit, true);
+  }
+
+  void vecenv_free(void *env)
+  {
+    delete (VecEnv *)env;
+  }
+
+  void vecenv_reset(void *env, const unsigned *seeds)
+  {
+    ((VecEnv *)env)->reset(seeds);
+  }
+
+  // Copies the rewards and done flags of the step into the caller's arrays of N
+  void vecenv_step(void *env, const int *actions, float *rewards, unsigned char *dones)
+  {
+    VecEnv *self = (VecEnv *)env;
+    self->step(actions);
+    memcpy(rewards, self->getRewards(), self->size() * sizeof(float));
+    memcpy(dones, self->getDones(), self->size());
+  }
+
+  const char *vecenv_observation(void *env, int i)
+  {
+    VecEnv *self = (VecEnv *)env;
+    myassert(i >= 0 && i < self->size(), "vecenv_observation: no env " + to_string(i));
+    return self->observations()[i].c_str();
+  }
+
+  // N views of vecenv_numeric_size() floats, updated in place by each step
+  const float *vecenv_numeric(void *env)
+  {
+    return ((VecEnv *)env)->numericObservations();
+  }
+
+  int vecenv_numeric_size()
+  {
+    return NumericView::size;
   }
-  winningScreen();
 }
 
 // main
+// Tools that bring their own main() (see bench/) define no_main
+#ifndef no_main
+
+// Maze files matching a glob pattern, in sorted order
+static vector<string> findMazes(const string &pattern)
+{
+  vector<string> paths;
+  glob_t found;
+  if (glob(pattern.c_str(), 0, nullptr, &found) == 0)
+    for (size_t i = 0; i < found.gl_pathc; ++i)
+      paths.push_back(found.gl_pathv[i]);
+  globfree(&found);
+  return paths;
+}
+
+// Final scores, for headless games that leave no video behind
+static void printScores(Game &game)
+{
+  for (Robot *bot : game.getPlayers())
+    cout << bot->getName() << ": " << bot->getflagCount() << " flags, " << bot->total_coin_collected << " coins" << endl;
+}
+
+// Plays one game (a 1-player game for a single agent) and renders its
+// frames into videopath; returns the winner as Game::getWinner does
+static int playGame(const string &mazepath, const vector<string> &agentcmds,
+                    const RenderTier &tier, const string &videopath)
+{
+  if (Game::rendering)
+  {
+    system("rm -r out/");
+    system(("rm " + videopath).c_str());
+    system("mkdir out/");
+  }
+
+  int winner = -1;
+  if (agentcmds.size() == 1)
+  {
+    // Game 1, initialize maze, players (w/ subprocesses), etc
+    Game game(mazepath, agentcmds[0], tier);
+
+    // Start simulating the game
+    game.play1();
+    if (!Game::rendering)
+      printScores(game);
+  }
+  else // Two or more players
+  {
+    // Game 2, intialize maze, players (w/ subprocesses), etc
+    Game game(mazepath, agentcmds, tier);
+
+    game.play2();
+    winner = game.getWinner();
+    if (!Game::rendering)
+      printScores(game);
+    std::cout << "Beautiful exit" << std::endl;
+  }
+
+  // Can render the frames as an mp4 once ~Game() returns:
+  if (Game::rendering)
+    system((string("ffmpeg -framerate ") + to_string(frame_per_sec / (double)tier.framestep) + string(" -pattern_type glob -i 'out/frame*.png' -c:v libx264 -pix_fmt yuv420p ") + videopath).c_str());
+  return winner;
+}
+
 int main(int argc, char **argv)
 {
+  // "--genmaze algo seed WxH out.maze" writes a generated maze and exits
+  if (argc == 6 && string(argv[1]) == "--genmaze")
+  {
+    MazeGen::fromSpec(string("gen:") + argv[2] + ":" + argv[3] + ":" + argv[4]).writeTo(argv[5]);
+    if (verbose)
+      cout << "Wrote " << argv[5] << endl;
+    return 0;
+  }
+
+  // Options come before the agent commands
+  string quality = "full";
+  string mazepath = "mazepool/0.maze";
+  string pool = "mazepool/*.maze*";
+  bool list = false, series = false;
+  string cpus = "";
+  while (argc >= 2 && string(argv[1]).compare(0, 2, "--") == 0)
+  {
+    const string opt = argv[1];
+    if (opt == "--headless")
+    {
+      Game::rendering = false;
+      argv += 1;
+      argc -= 1;
+      continue;
+    }
+    if (opt == "--conflate")
+    {
+      Agent::conflate = true;
+      argv += 1;
+      argc -= 1;
+      continue;
+    }
+    if (opt == "--warm")
+    {
+      AgentPool::enabled = true;
+      argv += 1;
+      argc -= 1;
+      continue;
+    }
+    if (opt == "--list" || opt == "--series")
+    {
+      (opt == "--list" ? list : series) = true;
+      argv += 1;
+      argc -= 1;
+      continue;
+    }
+    if (argc >= 3 && opt == "--trace")
+    {
+      Trace::path = argv[2];
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--metrics")
+    {
+      Game::metricspath = string(argv[2]) == "none" ? "" : argv[2];
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--metrics-every")
+    {
+      Game::metricsevery = (int)(atof(argv[2]) * frame_per_sec);
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--checkpoint")
+    {
+      Game::checkpointevery = (int)(atof(argv[2]) * frame_per_sec);
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--rays")
+    {
+      Game::rays = atoi(argv[2]);
+      myassert(Game::rays > 0, "--rays needs a positive number of rays");
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--restore")
+    {
+      Game::restorepath = argv[2];
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--spectate")
+    {
+      Spectators::path = argv[2];
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--cpus")
+    {
+      cpus = argv[2];
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc >= 3 && opt == "--magick-threads")
+    {
+      CpuBudget::magickthreads = atoi(argv[2]);
+      argv += 2;
+      argc -= 2;
+      continue;
+    }
+    if (argc < 3 || (opt != "--quality" && opt != "--maze" && opt != "--pool"))
+    {
+      argc = 0;
+      break;
+    }
+    (opt == "--quality" ? quality : opt == "--maze" ? mazepath : pool) = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+
+  if (list)
+  {
+    for (const string &path : findMazes(pool))
+    {
+      MazeData maze;
+      string error;
+      if (maze.load(path, error))
+        cout << path << "\t" << maze.w << "x" << maze.h << "\t" << maze.walls.size() << " walls" << endl;
+      else
+        cout << path << "\tinvalid: " << error << endl;
+    }
+    return 0;
+  }
+
+  if (argc < 2)
+  {
+    cout << "Use: ./server [--quality full|direct|preview] [--maze path/to/maze | gen:algo:seed:WxH] path/to/player.py [path/to/player2.py ...]" << endl
+         << "     ./server [--quality full|direct|preview] [--pool 'glob'] --series path/to/player.py [path/to/player2.py ...]" << endl
+         << "     metrics go to metrics.json / .csv; --metrics prefix|none, and --metrics-every seconds to stream them" << endl
+         << "     --trace file.json records a Chrome trace / Perfetto timeline" << endl
+         << "     --warm keeps agents running between series games, sending them \"reset\"" << endl
+         << "     --conflate sends slow agents only the latest observation, numbered by a \"seq N\" line" << endl
+         << "     --headless plays without rendering frames or writing video, and prints the scores" << endl
+         << "     --checkpoint S saves the game state to checkpoint.state every S seconds; --restore file.state resumes from one" << endl
+         << "     --rays K senses with K rays from each robot instead of every wall in view" << endl
+         << "     --spectate path.sock streams a line of game state per tick to local viewers" << endl
+         << "     --cpus SIM/RENDER/AGENTS (e.g. 0/1-3/4-7) or auto pins threads and agents; --magick-threads N" << endl
+         << "     ./server [--pool 'glob'] --list" << endl
+         << "     ./server --genmaze backtracker|kruskal|braid seed WxH out.maze" << endl
+         << endl;
+    return 0;
+  }
+  const vector<string> agentcmds(argv + 1, argv + argc);
+
+  string error;
+  if (cpus != "" && !CpuBudget::configure(cpus, agentcmds.size(), error))
+    myerror(error);
+  if (Spectators::path != "" && !Spectators::start(error))
+    myerror(error);
+
   // Initialize the API. Can pass NULL if argv is not available.
   InitializeMagick(*argv);
+  CpuBudget::limitMagick();
 
-  system("rm -r out/");
-  system("rm out.mp4");
-  system("rm out.mp4.tar.gz");
-  system("mkdir out/");
+  // An agent that exits mid-game must not take the server down with it
+  signal(SIGPIPE, SIG_IGN);
 
   if (verbose)
     cout << "GraphicsMagick Initialized" << endl;
 
+  RenderTier tier = RenderTier::byName(quality);
+
   try
   {
-    if (argc == 2)
+    if (!series)
     {
-      // Game 1, initialize maze, players (w/ subprocesses), etc
-      Game game("mazepool/0.maze", argv[1]);
+      if (!Game::rendering)
+      {
+        playGame(mazepath, agentcmds, tier, "");
+        Spectators::stop();
+        Trace::write();
+        return 0;
+      }
+      system("rm out.mp4.tar.gz");
+      playGame(mazepath, agentcmds, tier, "out.mp4");
+      system("tar -czvf out.mp4.tar.gz out.mp4");
+      cout << "Rendered output saved to out.mp4 and out.mp4.tar.gz" << endl;
+      Spectators::stop();
+      Trace::write();
+      return 0;
+    }
 
-      // Short pause to let subprocesses boot up
-      this_thread::sleep_for(chrono::milliseconds(250));
+    // Each series game writes its metrics next to its video
+    const string metricspath = Game::metricspath;
 
-      // Start simulating the game
-      game.play1();
-    }
-    else if (argc == 3) // Two player game
+    // Parse every maze up front, leaving out any that fail to validate
+    vector<string> mazepaths;
+    for (const string &path : findMazes(pool))
     {
-      // Game 2, intialize maze, players (w/ subprocesses), etc
-      Game game("mazepool/0.maze", argv[1], argv[2]);
-
-      game.play2();
-      std::cout << "Beautiful exit" << std::endl;
+      string error;
+      if (Game::preloadMaze(path, error))
+        mazepaths.push_back(path);
+      else
+        cout << "Skipping invalid maze " << error << endl;
     }
-    else
+    myassert(!mazepaths.empty(), "No valid mazes match " + pool);
+
+    // In N-player series each maze is played N times, with the agents
+    // rotating through the starting places (2 players swap sides); the games
+    // run back to back so they share the maze background
+    mkdir("series", 0755);
+    const int sides = agentcmds.size();
+    map<string, int> wins;
+    int ties = 0, gamenum = 0;
+    for (const string &path : mazepaths)
+      for (int rotated = 0; rotated < sides; ++rotated)
+      {
+        vector<string> seats;
+        for (int p = 0; p < sides; ++p)
+          seats.push_back(agentcmds[(p + rotated) % sides]);
+        const string gamepath = "series/game" + to_string(gamenum++);
+        // Headless games write no video, so their result lines show "-"
+        const string videopath = Game::rendering ? gamepath + ".mp4" : "-";
+        if (metricspath != "")
+          Game::metricspath = gamepath;
+        if (verbose)
+          cout << "Series game " << gamenum << ": " << path << (rotated ? " (sides rotated)" : "") << endl;
+        const int winner = playGame(path, seats, tier, videopath);
+        if (sides >= 2)
+        {
+          if (winner == -1)
+            ++ties;
+          else
+            ++wins[seats[winner]];
+        }
+        cout << videopath << "\t" << path << "\t" << (sides == 1 ? "-" : winner == -1 ? "tie" : seats[winner]) << endl;
+      }
+
+    cout << "Series of " << gamenum << " games over " << mazepaths.size() << " mazes" << endl;
+    if (sides >= 2)
     {
-      cout << "Use: ./server path/to/player.py" << endl
-           << endl;
+      // The same command in several seats shares its wins
+      set<string> listed;
+      for (const string &cmd : agentcmds)
+        if (listed.insert(cmd).second)
+          cout << cmd << ": " << wins[cmd] << " wins" << endl;
+      cout << ties << " ties" << endl;
     }
-
-    // Can render the frames as an mp4 once ~Game() returns:
-    system((string("ffmpeg -framerate ") + to_string(frame_per_sec) + string(" -pattern_type glob -i 'out/frame*.png' -c:v libx264 -pix_fmt yuv420p out.mp4")).c_str());
-    system("tar -czvf out.mp4.tar.gz out.mp4");
-    cout << "Rendered output saved to out.mp4 and out.mp4.tar.gz" << endl;
+    AgentPool::clear();
+    Spectators::stop();
+    Trace::write();
   }
   catch (Exception &error_)
   {
@@ -1487,3 +4852,5 @@ int main(int argc, char **argv)
 
   return 0;
 }
+
+#endif
@@ -5,8 +5,14 @@
 // For use with CS 660/760. All rights reserved.
 //
 
+#ifdef no_render
+#include "magick-null.hpp"
+#else
 #include <Magick++.h>
+#endif
 #include <set>
+#include <map>
+#include <tuple>
 #include <vector>
 #include <array>
 #include <cmath>
@@ -14,33 +20,72 @@
 #include <memory>
 #include <cstdio>
 #include <string>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
 #include <thread>
+#include <atomic>
+#include <deque>
 #include <future>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 #include <boost/process.hpp>
 #include <boost/lockfree/spsc_queue.hpp>
 #include <random>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 using namespace Magick;
 using namespace boost::process;
 
-#define tileW 11
-#define tileH 11
-
 #define renderW 2550
 #define renderH 2550
 
 #define frame_ms 600
 #define frame_per_sec 18
+// Match length; e.g. -Dgamelimit_sec=30 for quick headless runs
+#ifndef gamelimit_sec
 #define gamelimit_sec 240
+#endif
 #define framelimit (gamelimit_sec * frame_per_sec)
 
-#define gameX(x) (15 + x * ((renderW - 30.0) / tileW))
-#define gameY(y) (15 + y * ((renderH - 30.0) / tileH))
+// Size in tiles of the maze being drawn, for the drawing code outside Game.
+// Each Game has its own tileW / tileH, which the macros below use inside it
+inline int tileW = 11;
+inline int tileH = 11;
+
+// Tiles are square, sized so the larger maze dimension fills the game image
+#define tilePx ((renderW - 30.0) / max(tileW, tileH))
+#define gameX(x) (15 + (x) * tilePx)
+#define gameY(y) (15 + (y) * tilePx)
+
+// Sprites and strokes are drawn for 11x11 mazes and scale with the tiles
+#define spriteScale (11.0 / max(tileW, tileH))
+#define spriteHalf ((int)(64 * spriteScale))
+#define strokePx(w) max((w) * spriteScale, 1.0)
 
 #define Walls(x, y) (walls[((int)y) * (tileW + 1) + (int)x])
+// The wall on the unit edge going right (or down, if vertical) from corner x, y
+#define Edge(x, y, vertical) (edges[(((int)y) * (tileW + 1) + (int)x) * 2 + (vertical)])
 
 #define robot_r 0.26
 #define robot_maxv 2.75 / frame_per_sec
@@ -49,12 +94,41 @@ using namespace boost::process;
 #define log_len 16
 #define log_char_len 24
 
+#define textcache_max 256
+
+// How long to wait for every agent's himynameis before starting anyway
+#define agent_ready_ms 10000
+
+// Rewards in VecEnv for each coin collected and each flag brought home
+#define env_coin_reward 1.0f
+#define env_flag_reward 10.0f
+
+// Spans kept per thread in a trace, beyond which they are dropped
+#define trace_max_events (1 << 20)
+
+// Pre-rendered maze backgrounds are cached here, keyed by maze and settings
+#define mazecache_dir "cache/"
+#define mazecache_version 1
+
 constexpr int TWALL_COST = 6;     // coins
 constexpr int TWALL_DURATION = 15; // seconds
 
 #define verbose true
 
-unsigned long long mytime()
+// Set to true (e.g., -Dnative_render=true) to composite and scale frames
+// on raw RGBA buffers; GraphicsMagick is then only used to load images,
+// draw text, and write PNGs
+#ifndef native_render
+#define native_render false
+#endif
+
+// Set to false (e.g., -Dsim_specialize=false) to simulate every board size
+// and player count on the generic runtime-bounds path
+#ifndef sim_specialize
+#define sim_specialize true
+#endif
+
+inline unsigned long long mytime()
 {
   // returns unix time in milliseconds
   std::chrono::time_point<std::chrono::system_clock> now = std::chrono::system_clock::now();
@@ -62,36 +136,355 @@ unsigned long long mytime()
   return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
 }
 
-std::random_device _rd;
-std::mt19937 _mt(_rd());
-std::uniform_int_distribution<int> _dist(0, 10);
-double randomPos()
+inline unsigned long long mytime_us()
 {
-  return _dist(_mt) + 0.5;
+  // returns monotonic time in microseconds, for measuring durations
+  auto duration = std::chrono::steady_clock::now().time_since_epoch();
+  return std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
 }
 
-void myerror(string msg)
+inline std::random_device _rd;
+inline std::mt19937 _mt(_rd());
+// Center of a random tile along a maze dimension of n tiles
+inline double randomPos(int n, std::mt19937 &rng = _mt)
+{
+  return std::uniform_int_distribution<int>(0, n - 1)(rng) + 0.5;
+}
+
+// FNV-1a, used to key cached files by content
+inline unsigned long long hashBytes(const char *bytes, size_t len, unsigned long long h = 14695981039346656037ULL)
+{
+  for (size_t i = 0; i < len; ++i)
+    h = (h ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+  return h;
+}
+
+inline unsigned long long hashBytes(const string &bytes, unsigned long long h = 14695981039346656037ULL)
+{
+  return hashBytes(bytes.data(), bytes.size(), h);
+}
+
+inline void myerror(string msg)
 {
   cout << msg << endl;
   exit(1);
 }
 
-void myassert(bool cond, string msg = "Assertion failed")
+inline void myassert(bool cond, string msg = "Assertion failed")
 {
   if (!cond)
     myerror(msg);
 }
 
+// Histogram of non-negative samples in power-of-two buckets; one thread
+// records, any thread may read at the same time
+class Histogram
+{
+private:
+  static const int buckets = 40;
+  // counts[b] holds samples v with 2^(b-1) <= v < 2^b (counts[0]: v == 0)
+  atomic<unsigned long long> counts[buckets];
+  atomic<unsigned long long> n, sum, maxv;
+
+public:
+  Histogram();
+  Histogram(const Histogram &) = delete;
+  Histogram &operator=(const Histogram &) = delete;
+
+  void record(unsigned long long v);
+
+  // Forget all samples; only between uses
+  void clear();
+
+  unsigned long long count() const;
+  double mean() const;
+  unsigned long long max() const;
+  // Upper bound of the bucket holding the q-th quantile
+  unsigned long long quantile(double q) const;
+};
+
+// Named histograms exported at the end of a match, and optionally while it runs
+class Metrics
+{
+private:
+  class Entry
+  {
+  public:
+    string name;
+    string unit;
+    const Histogram *hist;
+  };
+  vector<Entry> entries;
+
+public:
+  Metrics();
+  ~Metrics();
+
+  // hist must stay alive until the last export
+  void add(const string &name, const string &unit, const Histogram *hist);
+
+  // One line, so it can also be streamed as JSON lines
+  string toJSON() const;
+  string toCSV() const;
+
+  // Writes prefix.json and prefix.csv
+  void write(const string &prefix) const;
+};
+
+// Which CPUs the simulation thread, the render threads and the agent
+// processes may run on, and how many threads GraphicsMagick may use itself
+class CpuBudget
+{
+private:
+  // Parses a list such as "0,2-5" into cpus
+  static bool parseList(const string &spec, vector<int> &cpus);
+  static void toMask(const vector<int> &cpus, cpu_set_t &mask);
+
+public:
+  // Empty for no pinning
+  static vector<int> sim, render, agents;
+  // Cap on GraphicsMagick's OpenMP threads, 0 to leave it alone
+  static int magickthreads;
+
+  // "SIM/RENDER/AGENTS" CPU lists (e.g. "0/1-3/4-7"), or "auto" to split the
+  // CPUs this process may use: one per agent, up to one per player for the
+  // simulation and its sensing, the rest for rendering
+  static bool configure(const string &spec, int players, string &error);
+
+  // Caps GraphicsMagick threads; must run after InitializeMagick
+  static void limitMagick();
+
+  // Pins the calling thread to cpus, when there are any
+  static void pinThread(const vector<int> &cpus);
+
+  // Pins the calling thread to cpus while in scope, then gives it back the
+  // CPUs it had, so that what it starts later doesn't inherit them
+  class Pin
+  {
+  private:
+    cpu_set_t saved;
+    bool pinned;
+
+  public:
+    Pin(const vector<int> &cpus);
+    ~Pin();
+  };
+
+  // Pins player p's agent process, giving each agent its own share of agents
+  static void pinAgent(int pid, int p, int players);
+};
+
+// Publishes a line of game state per tick to viewers on a Unix domain socket.
+// The simulation only pushes onto a lock-free queue; one thread broadcasts to
+// every viewer without blocking, skipping ticks for viewers that fall behind
+class Spectators
+{
+private:
+  class Viewer
+  {
+  public:
+    int fd;
+    // Rest of the line being sent; new ticks are skipped until it is out
+    string out;
+  };
+
+  static int listenfd;
+  static boost::lockfree::spsc_queue<string> *states;
+  static atomic<bool> stopping;
+  static thread *broadcaster;
+  // Only used by the broadcast thread
+  static vector<Viewer> viewers;
+  // The latest maze line, sent to viewers as they connect
+  static string maze;
+
+  static void broadcastloop();
+
+  // Sends what it can of the viewer's line; false once the viewer is gone
+  static bool flush(Viewer &viewer);
+
+public:
+  // Socket to listen on ("" for none)
+  static string path;
+
+  static bool enabled();
+
+  // Listens on path and starts broadcasting
+  static bool start(string &error);
+
+  // Queues a line for every viewer, dropping it if the queue is full
+  static void publish(const string &line);
+
+  // Disconnects viewers and removes the socket
+  static void stop();
+};
+
+// Chrome Trace Event (and Perfetto) timeline of spans, recorded without locks
+// into a buffer per thread, and written out once every thread is done
+class Trace
+{
+private:
+  class Event
+  {
+  public:
+    const char *name;
+    unsigned long long ts, dur;
+    long arg;
+  };
+  class Buffer
+  {
+  public:
+    string thread;
+    int tid;
+    vector<Event> events;
+    Buffer *next;
+  };
+  // All buffers ever made, newest first; only ever pushed onto
+  static atomic<Buffer *> buffers;
+  static atomic<int> nexttid;
+  static thread_local Buffer *local;
+
+  // This thread's buffer, made on first use
+  static Buffer *buffer();
+
+public:
+  // Trace file written by write(), "" to record nothing
+  static string path;
+
+  static inline bool enabled() { return !path.empty(); }
+
+  // Names the calling thread's track
+  static void nameThread(const string &name);
+
+  // A span of dur microseconds from ts on the calling thread's track; arg < 0 for none
+  static void record(const char *name, unsigned long long ts, unsigned long long dur, long arg);
+
+  // Call only after every traced thread has finished
+  static void write();
+};
+
+// Records a span from construction to destruction, when tracing
+class TraceSpan
+{
+private:
+  const char *name;
+  long arg;
+  unsigned long long t0;
+
+public:
+  TraceSpan(const char *_name, long _arg = -1);
+  ~TraceSpan();
+};
+
 class Line;
 class Circle;
 class Game;
 class Robot;
 
+// One frame's drawing operations in game-image pixels (at renderW x renderH),
+// recorded once per simulated frame so each view can be drawn at its own size
+class Scene
+{
+private:
+  class Item
+  {
+  public:
+    // A sprite with its top-left at (x0, y0), or a line from (x0, y0) to (x1, y1)
+    const Image *sprite;
+    double x0, y0, x1, y1;
+    double scale;
+    bool flop;
+    string color;
+    double width;
+  };
+  vector<Item> lines;
+  vector<Item> sprites;
+
+public:
+  // Scaled / flopped copies of sprites, kept by each render thread
+  class SpriteCache
+  {
+  private:
+    map<tuple<const Image *, int, int, bool>, Image> sized;
+
+  public:
+    const Image &get(const Image *sprite, int w, int h, bool flop);
+  };
+
+  Scene();
+  ~Scene();
+
+  void addSprite(const Image *sprite, double x0, double y0, double scale = 1.0, bool flop = false);
+  void addLine(double x0, double y0, double x1, double y1, const string &color, double width);
+
+  // Draws the scene scaled by zoom, with (ox, oy) of the zoomed image at the
+  // canvas origin; lines are drawn before sprites
+  void drawTo(Image &canvas, double zoom, int ox, int oy, SpriteCache &cache) const;
+};
+
+// Premultiplied RGBA8 pixel buffer used by the native render backend
+class Raster
+{
+private:
+  int w, h;
+  vector<uint32_t> px;
+  double strokewidth;
+  uint32_t strokecolor;
+  // Drawing is restricted to the clip box (x0, y0, x1, y1)
+  int clipx0, clipy0, clipx1, clipy1;
+
+public:
+  Raster();
+  Raster(int _w, int _h, uint32_t fill = 0);
+  Raster(const Image &img);
+  ~Raster();
+
+  int width() const;
+  int height() const;
+  uint32_t *row(int y);
+  const uint32_t *row(int y) const;
+
+  Image toImage() const;
+
+  // Parses "#rrggbb" into an opaque pixel
+  static uint32_t parseColor(const string &hex);
+
+  void strokeWidth(double _w);
+  void strokeColor(const string &hex);
+
+  void clip(int x0, int y0, int x1, int y1);
+  void unclip();
+
+  void fill(int x, int y, int fw, int fh, uint32_t color);
+
+  // Copies the same rectangle from an equally sized raster
+  void copyFrom(const Raster &src, int x, int y, int cw, int ch);
+
+  // Alpha-over blend of src with its top-left corner at (x, y)
+  void composite(const Raster &src, int x, int y);
+
+  void flop();
+
+  // Bilinear resize, used to enlarge sprites
+  Raster zoomed(int zw, int zh) const;
+
+  // Box-filter (area averaging) resample of a source rect into a dest rect
+  void resampleTo(Raster &dst, int sx, int sy, int sw, int sh,
+                  int dx, int dy, int dw, int dh) const;
+
+  // Antialiased, round-capped line in the current stroke
+  void drawLine(double x0, double y0, double x1, double y1);
+};
+
 class IElem
 {
 public:
   virtual ~IElem() {}
   virtual void drawTo(Image &) = 0;
+  virtual void drawTo(Raster &) = 0;
+  // Steps animations like drawTo, recording what would be drawn
+  virtual void addTo(Scene &) = 0;
+  // Pixel box (x0, y0, x1, y1) on the game image that drawTo will touch
+  virtual void drawBounds(int &, int &, int &, int &) const = 0;
   virtual void closestPoint(double, double, double &, double &) const = 0;
   virtual bool withinRange(double, double, double) const = 0;
   virtual double minAngleTo(double, double) const = 0;
@@ -128,6 +521,16 @@ public:
 
   void drawTo(Image &canvas);
 
+  // Draws scaled by zoom with (ox, oy) of the zoomed image at the canvas
+  // origin, for partial redraws and scaled backgrounds
+  void drawTo(Image &canvas, double zoom, int ox, int oy);
+
+  void drawTo(Raster &canvas);
+
+  void addTo(Scene &scene);
+
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
+
   virtual void visit(IElem *other);
 
   virtual void notify(Line *other);
@@ -159,15 +562,31 @@ private:
   bool visible;
   int framecount;
   string color[5] = {"#dc1c13", "#ea4c46", "#f07470", "#f1959b", "#f6bdc0"};
+  Game *game;
+
+  // Fade color for the current frame
+  int fadeIndex() const;
 
 public:
-  TWall(double x0, double y0, double x1, double y1);
+  TWall(double x0, double y0, double x1, double y1, Game *_game, int _framecount = 0);
+  // Copy for another game, see Game::clone
+  TWall(const TWall &tw, Game *_game);
   ~TWall();
   bool isvisible() const;
 
+  // Steps the timer, removing this TWall from the game once it expires
+  void advance();
+
   void drawTo(Image &canvas);
+  void drawTo(Raster &canvas);
+  void addTo(Scene &scene);
+
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
 
   string writeStatus() const;
+
+  // "twall x0 y0 x1 y1 framecount", see Game::saveState
+  string writeState() const;
 };
 
 class Circle : public IElem
@@ -192,6 +611,9 @@ public:
 
   virtual double maxAngleTo(double x0, double y0) const;
 
+  // Defaults to a 128x128 sprite centered on the circle
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
+
   double getA() const;
   double getV() const;
   double getX() const;
@@ -220,6 +642,10 @@ public:
   string writeStatus() const;
 
   void drawTo(Image &canvas);
+  void drawTo(Raster &canvas);
+  void addTo(Scene &scene);
+
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
 };
 
 class Flag : public Circle
@@ -228,18 +654,36 @@ private:
   int framecount;
   bool isgreen;
   Image flagimage[2];
+  Raster flagraster[2];
+
+  // Steps the wave / fade-out animation; returns the sprite to draw at
+  // the given scale, or -1 once the flag has faded out
+  int nextSpriteFrame(double &scale);
 
 public:
   Flag(bool _isgreen = false, double _x = 10.5, double _y = 10.5);
   ~Flag();
 
   void drawTo(Image &canvas);
+  void drawTo(Raster &canvas);
+  void addTo(Scene &scene);
+
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
+
   virtual void notify(Circle *circ);
 
   void captured();
   void returnBack();
+  // Being carried, from captured() until returnBack()
+  bool isCaptured() const;
+
+  bool isGreen() const;
 
   string writeStatus() const;
+
+  // "flag x y framecount", and reading back what follows the keyword
+  string writeState() const;
+  void readState(istream &in);
 };
 
 class Coin : public Circle
@@ -247,8 +691,12 @@ class Coin : public Circle
 private:
   int framecount;
   Image coinimage[8];
+  Raster coinraster[8];
   bool visible;
 
+  // Steps the spin animation; returns the sprite, or -1 while respawning
+  int nextSpriteFrame();
+
 public:
   Coin(double _x = 10.5, double _y = 10.5);
   ~Coin();
@@ -256,16 +704,107 @@ public:
   bool isvisible() const;
 
   void drawTo(Image &canvas);
+  void drawTo(Raster &canvas);
+  void addTo(Scene &scene);
+
+  virtual void drawBounds(int &x0, int &y0, int &x1, int &y1) const;
 
   virtual void notify(Circle *circ);
 
-  void captured();
+  // Respawns on a tile of a w x h maze, picked with the game's rng
+  void captured(mt19937 &rng, int w, int h);
 
   string writeStatus() const;
+
+  // "coin x y framecount visible", and reading back what follows the keyword
+  string writeState() const;
+  void readState(istream &in);
 };
 
 // are shot by the robot, and travel in a straight line towards a target from the robot.
 
+// An agent subprocess, with one thread writing observations to it and one
+// reading its lines back; agents can stay warm between games, see AgentPool
+class Agent
+{
+private:
+  string cmd;
+  ipstream childout;
+  opstream childin;
+  child proc;
+  boost::lockfree::spsc_queue<string> commands;
+  boost::lockfree::spsc_queue<string> observations;
+  // Time from sending an observation to the agent's next line, in microseconds
+  Histogram cmdus;
+  // When the latest unanswered observation went out, 0 once answered
+  atomic<unsigned long long> sent;
+  // Set once the agent has introduced itself with himynameis
+  atomic<bool> ready;
+  // Set by reset() until the agent introduces itself again; lines left over
+  // from the previous game are dropped meanwhile
+  atomic<bool> resetting;
+  atomic<bool> stopping;
+  // Declared last, as they use everything above
+  thread writer;
+  thread reader;
+
+  static void writeloop(Agent *self);
+  static void readloop(Agent *self);
+
+  // Writes an observation (or message) to the agent, and times its answer
+  void write(const string &text, bool timed);
+
+  // Whether the agent has read everything written to it so far
+  bool caughtUp();
+
+public:
+  // Send agents only the latest observation, numbered with a "seq N" line,
+  // once they have read the previous one
+  static bool conflate;
+
+  Agent(const string &_cmd);
+  ~Agent();
+
+  const string &getCmd() const;
+  int getPid();
+
+  // Queues an observation for the agent
+  void send(const string &view);
+
+  // The agent's next line, if there is one
+  bool receive(string &line);
+
+  bool isReady() const;
+
+  // Still running, and introduced itself for the current game
+  bool isHealthy();
+
+  // Sends "reset" to start a new game; ready again once the agent says himynameis
+  void reset();
+
+  const Histogram &getCmdLatency() const;
+};
+
+// Agent processes kept warm between the games of a series, by command line
+class AgentPool
+{
+private:
+  static map<string, vector<Agent *>> idle;
+
+public:
+  // Off by default, as agents must understand "reset" to be reused
+  static bool enabled;
+
+  // An idle agent for cmd, reset for a new game, or else a new one
+  static Agent *acquire(const string &cmd);
+
+  // Keeps a healthy agent for a later game, otherwise shuts it down
+  static void release(Agent *agent);
+
+  // Shuts down every idle agent
+  static void clear();
+};
+
 class Robot : public Circle
 {
 private:
@@ -282,23 +821,28 @@ private:
   Flag *flagCaptured;
   Game *game;
 
-  // Subprocess-related members
-  ipstream childout;
-  opstream childin;
-  child proc;
-  boost::lockfree::spsc_queue<string> commands;
-  boost::lockfree::spsc_queue<string> observations;
-  thread messenger;
+  // Subprocess, owned by AgentPool
+  Agent *agent;
 
-  // Run in each ctor as dedicated thread for communication
-  static void readloop(Robot *self);
+  // Steps the walk animation and picks the sprite for the current heading
+  int nextSpriteFrame(bool &flop);
 
 public:
   Image greenbot[45];
+  Raster botraster[45];
   int total_coin_collected;
+  // Launches the agent; sprites are loaded separately, see loadSprites.
+  // An empty cmd makes a robot without an agent, moved by Game::command
   Robot(string cmd, double _x, double _y, Game *_game, bool isgreen = true);
+  // Copy without an agent for another game, see Game::clone
+  Robot(const Robot &bot, Game *_game, Flag *_flagCaptured);
   virtual ~Robot();
 
+  void loadSprites();
+
+  bool isReady() const;
+  int getAgentPid();
+
   double getHomeX();
   double getHomeY();
   int getflagCount();
@@ -307,17 +851,32 @@ public:
 
   vector<string> getLog() const;
 
+  // The flag this robot is carrying home, if any
+  Flag *getCarriedFlag() const;
+
+  const Histogram &getCmdLatency() const;
+
   void drawTo(Image &canvas);
+  void drawTo(Raster &canvas);
+  void addTo(Scene &scene);
 
   virtual void move();
 
   void play(string view);
 
+  // Apply one agent command; false for non-behavioral ones (names, comments)
+  bool runCommand(const string &cmd);
+
   void notify(Circle *flag_or_home);
 
   string getName() const;
 
   string writeStatus() const;
+
+  // "robot x y v a tx ty ... name", with the carried flag as an index into
+  // objects, and reading back what follows the keyword
+  string writeState(const vector<IElem *> &objects) const;
+  void readState(istream &in, const vector<IElem *> &objects);
 };
 
 class LineAngle
@@ -331,19 +890,327 @@ public:
   string writeStatus() const;
 };
 
+// Paces the game loop against absolute deadlines on the monotonic clock, so
+// a late tick shortens the next one instead of pushing back every later one,
+// and sleeps through each wait instead of spinning
+class TickClock
+{
+public:
+  // A tick that finished after its deadline, and where its time went
+  class Overrun
+  {
+  public:
+    int frame;
+    unsigned long long lateus, stepus, composeus;
+  };
+
+private:
+  long long periodns;
+  // End of the current tick, in CLOCK_MONOTONIC nanoseconds
+  long long deadline;
+  vector<Overrun> overruns;
+
+  static long long now();
+
+public:
+  TickClock(int period_ms);
+
+  // Sleeps until the end of the current tick, given how long its simulation
+  // step and frame compose took; returns how late the tick already was (us)
+  unsigned long long wait(int frame, unsigned long long stepus, unsigned long long composeus);
+
+  const vector<Overrun> &getOverruns() const;
+
+  // Writes frame, lateness and phase times of each overrun as CSV
+  void writeOverruns(const string &path) const;
+};
+
+// Read-only memory map of a whole file
+class MappedFile
+{
+private:
+  int fd;
+  void *addr;
+  size_t len;
+
+public:
+  MappedFile(const string &path);
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  bool isOpen() const;
+  const char *data() const;
+  size_t size() const;
+};
+
+// A validated maze: its size in tiles and its interior walls, without the border
+class MazeData
+{
+private:
+  // Checks a parsed wall, returning an error message or ""
+  string checkWall(const array<int, 4> &wall, set<array<int, 4>> &seen) const;
+
+  bool parseText(const char *data, size_t len, string &error);
+
+  bool parseBinary(const char *data, size_t len, string &error);
+
+public:
+  int w, h;
+  vector<array<int, 4>> walls;
+  // Hash of the source bytes, see Game::mazeCachePath
+  unsigned long long hash;
+
+  MazeData();
+
+  // Parse a text maze ("size W H" then "wall x0 y0 x1 y1" lines) or a binary
+  // one (see toBinary); on failure, error holds "line N: message" (or
+  // "offset N: message" for binary mazes) and false is returned
+  bool parse(const char *data, size_t len, string &error);
+
+  // Memory-map and parse a maze file; errors are prefixed with the path
+  bool load(const string &path, string &error);
+
+  // "MAZB", then little-endian uint16 version, w, h, uint32 wall count,
+  // then uint16 x0, y0, x1, y1 per wall
+  string toBinary() const;
+};
+
+// Seeded procedural maze generator; the same algorithm, seed and size always
+// produce the same maze, on any platform
+class MazeGen
+{
+private:
+  int w, h;
+  mt19937 rng;
+  // Interior walls still standing: east[y * w + x] lies between tiles (x, y)
+  // and (x + 1, y), south[y * w + x] between (x, y) and (x, y + 1)
+  vector<bool> east, south;
+
+  // Uniform enough in [0, n), and unlike std distributions, portable
+  int pick(int n);
+
+  // Remove the wall between neighbouring tiles a and b (indices y * w + x)
+  void carve(int a, int b);
+
+  int wallCount(int cell) const;
+
+  void backtracker();
+
+  void kruskal();
+
+  // Knock through dead ends with the given probability, adding loops
+  void braid(double loops);
+
+public:
+  // algo is "backtracker", "kruskal" or "braid"
+  MazeGen(const string &algo, unsigned seed, int _w, int _h);
+
+  // Contents of the equivalent .maze file
+  string toString() const;
+
+  // Writes the binary format when path ends in .mazeb
+  void writeTo(const string &path) const;
+
+  // Maze paths of the form "gen:algo:seed:WxH" are generated, not read
+  static bool isSpec(const string &mazepath);
+
+  static MazeGen fromSpec(const string &spec);
+};
+
+// Render quality tier, trading output size and frame rate for render time
+class RenderTier
+{
+public:
+  // Draw each view at its output size from the frame's Scene, instead of
+  // drawing the whole game at renderW x renderH and scaling it down
+  bool direct;
+  // Output size relative to 1920x1080
+  double scale;
+  // Render every framestep-th simulated frame
+  int framestep;
+
+  RenderTier(bool _direct = false, double _scale = 1.0, int _framestep = 1);
+
+  // "full", "direct" (1080p), or "preview" (direct, 720p, half the frames)
+  static RenderTier byName(const string &name);
+};
+
+// Maze dimensions fixed at compile time, or the game's tileW/tileH when 0
+template <int W, int H>
+class BoardDims
+{
+public:
+  static_assert(W >= 0 && H >= 0, "board dimensions must be non-negative");
+  static_assert((W > 0) == (H > 0), "board dimensions are both fixed or both runtime");
+
+  static inline int w(int tileW) { return W > 0 ? W : tileW; }
+  static inline int h(int tileH) { return H > 0 ? H : tileH; }
+  // Index of tile (x, y) in Game::walls
+  static inline int cell(int x, int y, int tileW) { return y * (w(tileW) + 1) + x; }
+};
+
+// Persistent threads that run a job over indices 0..n-1 together, each
+// taking a contiguous share; the calling thread takes the first share
+class WorkerPool
+{
+private:
+  vector<thread> workers;
+  mutex lock;
+  condition_variable wake, finished;
+  const function<void(int)> *job;
+  int jobsize, generation, pending;
+  bool stopping;
+
+  static void workloop(WorkerPool *self, int w, string name, vector<int> cpus);
+
+  // Runs the w-th of size() shares of the current job
+  void runShare(int w);
+
+public:
+  // threads counts the caller, so 1 (or less) runs every job inline.
+  // Workers are named name0, name1... in traces and pinned to cpus
+  WorkerPool(int threads, const string &name, const vector<int> &cpus = vector<int>());
+  ~WorkerPool();
+
+  // Threads a job is split over, the caller included
+  int size() const;
+
+  // Runs fn(i) for every i in [0, n), returning once all are done
+  void run(int n, const function<void(int)> &fn);
+};
+
+// One simulated frame: sense, act, and collide for every player
+class ISimStep
+{
+public:
+  virtual ~ISimStep() {}
+  virtual void step(Game &game, set<IElem *> &visible) = 0;
+
+  // Specialized for the common board sizes and player counts, generic otherwise
+  static ISimStep *create(int w, int h, int players);
+};
+
+// Simulation step with board size W x H and P players known at compile time;
+// SimStep<0, 0, 0> reads them at runtime
+template <int W, int H, int P>
+class SimStep : public ISimStep
+{
+public:
+  static_assert(P >= 0, "player count must be non-negative");
+
+  void step(Game &game, set<IElem *> &visible);
+
+  // Bounce bot off the walls near it and trigger any objects it touches
+  static void collide(Game &game, Robot *bot);
+};
+
+// Layout of the float observations written by Game::senseNumeric, as an
+// alternative to the text view: planes over the tiles within sensing range of
+// the robot's tile (row-major, top-left first), then the robot's own state
+class NumericView
+{
+public:
+  static constexpr int range = 5;
+  static constexpr int tiles = 2 * range + 1;
+  // Visible walls at half-tile resolution: even cells are tile corners, odd
+  // ones tile middles, and the rest the edges between them
+  static constexpr int wallcells = 2 * tiles + 1;
+  static constexpr int walls = 0;
+  // Coins per tile
+  static constexpr int coins = walls + wallcells * wallcells;
+  // 1 for a green flag, -1 for a red one
+  static constexpr int flags = coins + tiles * tiles;
+  // Other robots per tile
+  static constexpr int robots = flags + tiles * tiles;
+  // x and y within the tile, speed, cos and sin of the heading, coins
+  // carried, and 1 while carrying a flag
+  static constexpr int self = robots + tiles * tiles;
+  static constexpr int size = self + 7;
+};
+
 class Game
 {
 private:
+  template <int W, int H, int P>
+  friend class SimStep;
+  // Microbenchmarks, see bench/
+  friend class GameBench;
+
   // Image greenbot[45];
   Image mazeimage, bgimage;
 
-  vector<Line *> walls[(tileW + 1) * (tileH + 1)];
+  // Native backend copies of the above
+  Raster mazeraster, bgraster;
+
+  RenderTier tier;
+  // Frames sent down the render pipeline per game
+  int renderlimit;
+  // Maze backgrounds at main view and focus view zoom, for direct tiers
+  Image mainmaze, focusmaze;
+
+  // Previous game image and what was drawn onto it, for dirty-rect redraws
+  Image lastframe;
+  shared_ptr<Raster> lastraster;
+  vector<array<int, 4>> lastrects;
+  set<Line *> lastwalls;
+
+  // Maze size in tiles; 11x11 unless the maze file starts with "size W H"
+  int tileW, tileH;
+  // Walls by the tile of their first endpoint, (tileW + 1) * (tileH + 1)
+  vector<vector<Line *>> walls;
+  // Axis-aligned walls by unit edge, for ray casting; see Edge and indexEdges
+  vector<Line *> edges;
   vector<Robot *> players;
   vector<IElem *> objects;
 
   int framecount;
   unsigned long long starttime;
-  unsigned long long frametime;
+
+  // Hash of the loaded maze file, for the background cache
+  unsigned long long mazehash;
+
+  // Coin placement, seeded from _mt, so clones and restored games replay alike
+  mt19937 rng;
+
+  // A clone: no agents, render pipeline or metrics, and not the singleton
+  bool headless;
+
+  // Frame the game started (or was restored) at; agents get the maze size then
+  int startframe;
+
+  // Timings of this match, see registerMetrics
+  Metrics metrics;
+  Histogram stepus, composeus;
+  // How late each tick finished, 0 when on time
+  Histogram lateus;
+  // Sensing time per player
+  deque<Histogram> senseus;
+  // Senses the players at once each tick, see SimStep::step
+  WorkerPool *sensors;
+  // Per render stage: time per frame, and queue depth when a frame is taken
+  Histogram stageus[5];
+  Histogram queuedepth[5];
+
+  // Copies other's simulation state into a headless game, see clone
+  Game(const Game &other);
+
+  // Finishes construction once the agents are launched: loads player sprites
+  // and pre-renders the maze while they boot, waits for them, and starts the
+  // render threads
+  void setup();
+
+  // Waits up to agenttimeout ms for every agent's handshake
+  void waitForAgents();
+
+  // Registers the histograms above, once players are known
+  void registerMetrics();
+
+  // Every metricsevery frames, appends the metrics so far to metricspath.stream.jsonl
+  void streamMetrics();
+
+  // Every checkpointevery frames, replaces checkpointpath with saveState()
+  void writeCheckpoint();
 
   static Game *game_singleton;
 
@@ -352,18 +1219,52 @@ private:
   public:
     Image *frame;
     Image *screen;
+    // Native backend frames, used instead of the above until stage 3
+    shared_ptr<Raster> rframe;
+    Raster *rscreen;
+    // Direct tiers send the frame's Scene instead of a game image
+    Scene *scene;
     int x0, y0, x1, y1;
+    // Scoreboard rows; a negative count hides that field (1-player caption row)
     string name0;
+    int flags0, coins0;
     string name1;
+    int flags1, coins1;
     vector<string> log0;
     vector<string> log1;
-    RenderMessage(Image *_frame,
+    RenderMessage(Image *_frame, shared_ptr<Raster> _rframe, Scene *_scene,
                   int _x0, int _y0, int _x1, int _y1,
-                  string nm0, string nm1,
+                  string nm0, int fl0, int cn0,
+                  string nm1, int fl1, int cn1,
                   vector<string> _log0, vector<string> _log1);
     ~RenderMessage();
   };
 
+  // Rasterized text strips keyed by content, so stage 3 only renders
+  // fonts for lines that changed since an earlier frame
+  class TextCache
+  {
+  private:
+    class Strip
+    {
+    public:
+      Image img;
+      int lastframe;
+    };
+    map<string, Strip> strips;
+    int framecount;
+
+  public:
+    TextCache();
+    ~TextCache();
+
+    void drawTo(Image &canvas, const string &text, int pointsize,
+                int w, int h, int x, int y);
+
+    // Evicts strips unused this frame once the cache grows past textcache_max
+    void nextFrame();
+  };
+
   // 5-stage render pipeline (thread methods just below)
   vector<boost::lockfree::spsc_queue<RenderMessage *> *> to_renderer;
   vector<thread *> renderers;
@@ -386,16 +1287,68 @@ private:
   // Stage 4: Write to file as compressed PNG
   static void renderloop4(Game *self);
 
-  static void renderMazeRow(int off, promise<Image *> &resp, Game *self);
+  // Scales a layout coordinate on the 1920x1080 screen to the tier's size
+  int ui(double v) const;
+
+  double mainZoom() const;
+  double focusZoom() const;
+
+  static void renderMazeRow(int off, double zoom, promise<Image *> &resp, Game *self);
 
-  void renderMaze();
+  void renderMaze(Image &target, double zoom);
+
+  string mazeCachePath(double zoom) const;
+
+  // Raw RGBA background files; reading fails quietly on any mismatch
+  static bool readMazeCache(Image &target, const string &path);
+  static void writeMazeCache(const Image &img, const string &path);
+
+  // Pre-renders the maze backgrounds this tier needs
+  void setupRender();
+
+  // Mazes parsed so far by this process, by path, so a series reads each once
+  static map<string, MazeData> mazes;
+  // Rendered backgrounds of the current maze, by cache path (see mazeCachePath);
+  // swapped games on the same maze reuse them
+  static map<string, Image> backgrounds;
+  static unsigned long long backgroundhash;
 
   void loadMaze(string mazepath);
 
+  // Splits visible elements into walls and sprites and collects the regions
+  // that changed since the last frame
+  void findDirtyRects(set<IElem *> &visible, set<Line *> &wallsnow,
+                      vector<IElem *> &sprites, vector<array<int, 4>> &dirty);
+
+  Image *composeImage(set<Line *> &wallsnow, vector<IElem *> &sprites,
+                      vector<array<int, 4>> &dirty);
+
+  shared_ptr<Raster> composeRaster(set<Line *> &wallsnow, vector<IElem *> &sprites,
+                                   vector<array<int, 4>> &dirty);
+
   void renderFrame(set<IElem *> &visible);
 
+  // Steps the animations, coin respawns and TWall timers of what is visible,
+  // for a frame that is not drawn
+  void animate(set<IElem *> &visible);
+
   void addCoins(vector<IElem *> &objects);
 
+  // Coins, then flags and homes (a flag at each home beyond 1 player), in the
+  // order saved states expect
+  void placeObjects();
+
+  // Where player p of n starts, and has its home: spread evenly around the
+  // outermost tiles, so the second of two starts in the opposite corner
+  void startOf(int p, int n, double &x, double &y) const;
+
+  // The two players the focus views and scoreboard follow: 0 and 1, or in
+  // bigger matches the two in the lead
+  void featured(int &a, int &b);
+
+  // A game without agents or rendering, see simulation
+  Game(const string &mazepath, int players);
+
   double elem_dist(double x, double y, Line *el);
 
   double elem_rad_dist(double x, double y, const LineAngle *el0, const LineAngle *el1);
@@ -409,19 +1362,109 @@ private:
 
   void winningScreen();
 
-  int getWinner();
+  // Rebuilds edges from walls, whenever walls change
+  void indexEdges();
+
+  // The rays view: objects in range with a clear line of sight, and a line
+  // per ray instead of the walls
+  string senseRaysFrom(Robot *bot, set<IElem *> &visible);
+
+  // What bot can see: the objects in range and the wall behind each unblocked
+  // wall section
+  template <int W, int H>
+  void lookFrom(Robot *bot, set<IElem *> &visible, set<IElem *> &nearby, vector<Line *> &seen);
+
+  // Wall grid bounds as template arguments, see BoardDims
+  template <int W, int H>
+  string senseFrom(Robot *bot, set<IElem *> &visible);
 
 public:
-  Game(string mazepath, string agentcmd);
+  Game(string mazepath, string agentcmd, const RenderTier &_tier = RenderTier());
+
+  Game(string mazepath, string agent1cmd, string agent2cmd, const RenderTier &_tier = RenderTier());
 
-  Game(string mazepath, string agent1cmd, string agent2cmd);
+  // A match between every agent in agentcmds, each with its own home and flag
+  Game(string mazepath, const vector<string> &agentcmds, const RenderTier &_tier = RenderTier());
 
   ~Game();
 
   static Game *getGame();
 
+  // Headless copy of the simulation without agents or rendering, moved on
+  // only by command() and advance(); cheap enough for many rollouts
+  Game *clone() const;
+
+  // A new headless game on mazepath, like clone() of a fresh match
+  static Game *simulation(const string &mazepath, int players = 1);
+
+  // Reseeds the coin rng and scatters the coins again, as a new game would
+  void reseed(unsigned seed);
+
+  // Full simulation state: frame, rng, players, coins, flags and TWalls.
+  // Restoring needs a Game on the same maze with the same number of players
+  string saveState() const;
+  void restoreState(const string &state);
+
+  // Applies a command for player p as if its agent had sent it
+  bool command(int p, const string &cmd);
+
+  // One tick of movement, collisions and timers, without agents; timers step
+  // for what the players can see, as in the real game
+  void advance();
+
+  int getFrame() const;
+  int getTileW() const;
+  int getTileH() const;
+  const vector<Robot *> &getPlayers() const;
+  mt19937 &getRng();
+
+  // Set to false before constructing a Game to run the render stages by hand
+  static bool renderthreads;
+  // False to play without loading sprites, drawing frames or writing video;
+  // always false when built with -Dno_render
+  static bool rendering;
+  // How long a new Game waits for its agents to say himynameis (ms)
+  static int agenttimeout;
+
+  // Prefix of the metrics files written when a Game ends ("" for none)
+  static string metricspath;
+  // Stream metrics every this many frames while playing (0 for never)
+  static int metricsevery;
+
+  // Save the game state to checkpointpath every this many frames (0 for never)
+  static string checkpointpath;
+  static int checkpointevery;
+  // Game state a new Game resumes from ("" to start afresh)
+  static string restorepath;
+  // Rays agents are sensed with, spread evenly from their heading (0 for the
+  // walls in view instead)
+  static int rays;
+
+  // Parse and validate a maze ahead of time, keeping it for later games
+  static bool preloadMaze(const string &mazepath, string &error);
+
+  // Players by flags brought home, then coins collected (earlier players first on a tie)
+  vector<int> ranking();
+
+  // Index of the winning player of a match, or -1 on a tie for first
+  int getWinner();
+
   string writeRenderViewFrom(Robot *bot, set<IElem *> &visible);
 
+  // The same view as NumericView::size floats at out
+  void senseNumeric(Robot *bot, float *out, set<IElem *> &visible);
+
+  // Distance from x, y along angle a to the first wall, crossing the grid a
+  // tile at a time; range (and hit null) if there is none that close
+  double castRay(double x, double y, double a, double range, Line *&hit);
+  // k rays from bot, the first along its heading
+  void castRays(Robot *bot, int k, double range, double *dist, Line **hit);
+
+  // For spectators: "maze W H" and every wall, then a line per tick with the
+  // players, coins, flags and TWalls, as ';'-separated agent protocol lines
+  string writeMazeState();
+  string writeTickState();
+
   void addTWall(double x0, double y0, double x1, double y1);
 
   void removeTWall(TWall *twall);
@@ -432,3 +1475,65 @@ public:
 
   void play2();
 };
+
+// N independent 1-player games on copies of one maze, stepped in lockstep and
+// spread over a thread pool, for training agents in-process instead of through
+// ./server. Results of the last reset or step are kept in contiguous arrays of N
+class VecEnv
+{
+private:
+  Game *base;
+  vector<Game *> envs;
+  vector<unsigned> seeds;
+  // Steps per episode; an env that reaches it is done and starts over
+  int episode;
+  // Score so far in each env's episode, to turn into rewards
+  vector<int> flags, coins;
+
+  // Views as text, or as NumericView floats per env when numeric
+  bool numeric;
+  vector<string> obs;
+  vector<float> grids;
+  vector<float> rewards;
+  vector<uint8_t> dones;
+
+  // Each thread steps a contiguous share of the envs
+  WorkerPool pool;
+
+  void resetEnv(int i, unsigned seed);
+  void stepEnv(int i, int action);
+  void observe(int i);
+
+public:
+  // Moves toward the middle of this tile or a neighboring one
+  enum Action
+  {
+    stay,
+    up,
+    down,
+    left,
+    right
+  };
+
+  VecEnv(const string &mazepath, int n, int threads = thread::hardware_concurrency(), int _episode = framelimit,
+         bool _numeric = false);
+  ~VecEnv();
+
+  int size() const;
+
+  // Starts every env over with seeds[i] placing its coins
+  void reset(const unsigned *seeds);
+
+  // Applies actions[i] (an Action) to env i, then moves every env on a tick.
+  // Rewards are env_coin_reward per coin and env_flag_reward per flag brought
+  // home; done envs are reset with their seed plus N
+  void step(const int *actions);
+
+  // Each env's view after the last reset or step, as sent to agents; only
+  // in text mode
+  const string *observations() const;
+  // Or in numeric mode, N views of NumericView::size floats one after another
+  const float *numericObservations() const;
+  const float *getRewards() const;
+  const uint8_t *getDones() const;
+};
@@ -9,16 +9,28 @@ import select
 
 print("himynameis Rando-Bot", flush=True)
 
-time.sleep(0.25)
+# Block until the game starts and sends the first sense data
+select.select([sys.stdin,],[],[])
 
+last = 0
 while True:  
+  # wait for input, but only until the next move is due, so a reset is
+  # answered right away instead of after the sleep
+  select.select([sys.stdin,],[],[],max(0, last + 11 - time.time()))
   # while there is new input on stdin:
   while select.select([sys.stdin,],[],[],0.0)[0]:
     # read and process the next 1-line observation
     obs = sys.stdin.readline()
-    if obs == "close": exit(0)
-  x = random.randint(-10,25)
-  y = random.randint(-10,25)
-  print("toward %s %s" % (x,y), flush=True)
-  time.sleep(11)
+    if obs == "" or obs.strip() == "close": exit(0)
+    # kept running for another game; nothing to forget
+    if obs.strip() == "reset":
+      print("himynameis Rando-Bot", flush=True)
+      # move as soon as the next game sends its first sense data
+      last = 0
+      select.select([sys.stdin,],[],[])
+  if time.time() - last >= 11:
+    x = random.randint(-10,25)
+    y = random.randint(-10,25)
+    print("toward %s %s" % (x,y), flush=True)
+    last = time.time()
 
@@ -0,0 +1,53 @@
+import sys
+import socket
+import selectors
+import time
+
+# Follows any number of servers started with --spectate path.sock, printing
+# the state of each match once a second:
+#   python3 spectate.py match1.sock match2.sock ...
+
+if len(sys.argv) < 2:
+  print("Use: python3 spectate.py path.sock [path2.sock ...]")
+  exit(0)
+
+sel = selectors.DefaultSelector()
+matches = {}
+for path in sys.argv[1:]:
+  s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+  s.connect(path)
+  s.setblocking(False)
+  sel.register(s, selectors.EVENT_READ, path)
+  matches[path] = {"buf": b"", "maze": "?", "tick": 0, "players": [], "coins": 0, "twalls": 0}
+
+def update(match, line):
+  items = line.split(";")
+  head = items[0].split(" ")
+  if head[0] == "maze":
+    match["maze"] = "%sx%s" % (head[1], head[2])
+  elif head[0] == "tick":
+    match["tick"] = int(head[1])
+    match["players"] = [i.split(" ") for i in items if i.startswith("player ")]
+    match["coins"] = sum(1 for i in items if i.startswith("coin "))
+    match["twalls"] = sum(1 for i in items if i.startswith("twall "))
+
+last = 0
+while matches:
+  for key, _ in sel.select(timeout=0.25):
+    path = key.data
+    data = key.fileobj.recv(65536)
+    if not data:
+      print("%s: match over" % path, flush=True)
+      sel.unregister(key.fileobj)
+      del matches[path]
+      continue
+    match = matches[path]
+    match["buf"] += data
+    *lines, match["buf"] = match["buf"].split(b"\n")
+    for line in lines:
+      update(match, line.decode())
+  if time.time() - last >= 1:
+    last = time.time()
+    for path, m in matches.items():
+      bots = "  ".join("p%s (%.1f, %.1f) coins %s flags %s" % (p[1], float(p[2]), float(p[3]), p[6], p[5]) for p in m["players"])
+      print("%s %s tick %d: %s  [%d coins, %d twalls left]" % (path, m["maze"], m["tick"], bots, m["coins"], m["twalls"]), flush=True)